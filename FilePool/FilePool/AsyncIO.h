@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef POOLTESTS_ASYNCIO_H
+#define POOLTESTS_ASYNCIO_H
+
+#include "FileHandler.h"
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SourceXtractor {
+
+/**
+ * Asynchronous and batched positional I/O on top of the FileHandlers.
+ * @details
+ *  Batches are run by a pool of worker threads. A worker takes one accessor per distinct file of the
+ *  batch, so the descriptors come from the handlers and count towards the limit of their FileManager,
+ *  and keeps them until all the requests of the batch are done. They are taken all at once with
+ *  FileHandler::getAccessors, so workers waiting for descriptors can not deadlock each other. If that
+ *  fails (i.e. a file can not be opened, or the files belong to different managers), the files of the
+ *  batch are done one after the other, so an error only fails the requests of its file.
+ *  If io_uring is available, each worker submits the requests of a batch together through its own ring,
+ *  so a batch of many small reads costs a couple of system calls. Otherwise, each worker does them one
+ *  after the other with pread/pwrite.
+ *
+ *  The descriptor type must give access to the underlying file descriptor, declaring
+ *  `static int nativeHandle(const TFD& fd)` on its OpenCloseTrait. To write, it must also declare
+ *  `openUpdate`, opening for reading and writing without truncating: the descriptor of a file can be
+ *  closed between two batches, and each batch only writes its own regions.
+ * @warning
+ *  Keep the number of distinct files in a batch below the limit of the FileManager, since the
+ *  descriptors are only released when the whole batch is done. Otherwise, the batch can not be
+ *  acquired at once, and falls back to one file at a time.
+ */
+class AsyncIO {
+public:
+  /// Called once the request is done, from a worker thread. The error is null on success.
+  using Callback = std::function<void(std::size_t transferred, std::exception_ptr error)>;
+
+  enum Operation { kRead, kWrite };
+
+  struct Request {
+    std::shared_ptr<FileHandler> m_handler;
+    off_t                        m_offset;
+    std::size_t                  m_length;
+    /// Must be kept alive by the caller until the request is done
+    char*    m_buffer;
+    Callback m_callback;
+  };
+
+  /**
+   * Constructor
+   * @param nthreads
+   *    Number of worker threads. If 0, it will use the number of hardware threads.
+   * @param queue_depth
+   *    Maximum number of requests submitted at once by each worker
+   * @param use_uring
+   *    If false, or io_uring can not be used, the workers fall back to pread/pwrite
+   */
+  explicit AsyncIO(unsigned nthreads = 0, unsigned queue_depth = 64, bool use_uring = true);
+
+  /// Destructor. Waits for the pending batches.
+  virtual ~AsyncIO();
+
+  /**
+   * Queue a batch of requests. The callback of each request is called once it is done.
+   * @details
+   *    The number of bytes transferred can be less than requested only if the end of the file is reached.
+   */
+  template <typename TFD>
+  void submit(Operation op, std::vector<Request> requests);
+
+  /// Queue a batch of reads, ignoring their callbacks, and return one future per request
+  template <typename TFD>
+  std::vector<std::future<std::size_t>> read(std::vector<Request> requests);
+
+  /// Queue a batch of writes, ignoring their callbacks, and return one future per request
+  template <typename TFD>
+  std::vector<std::future<std::size_t>> write(std::vector<Request> requests);
+
+  /// @return true if the workers use io_uring
+  bool usesUring() const;
+
+private:
+  class Uring;
+
+  using Batch = std::function<void(Uring*)>;
+
+  struct Result {
+    std::size_t        m_transferred = 0;
+    std::exception_ptr m_error;
+  };
+
+  bool                     m_use_uring;
+  unsigned                 m_queue_depth;
+  std::mutex               m_mutex;
+  std::condition_variable  m_cv;
+  std::deque<Batch>        m_batches;
+  bool                     m_stop;
+  std::vector<std::thread> m_workers;
+
+  void enqueue(Batch batch);
+  void workerLoop();
+
+  template <typename TFD>
+  std::vector<std::future<std::size_t>> submitWithFutures(Operation op, std::vector<Request> requests);
+
+  /**
+   * Do the I/O of a batch, once the descriptors have been acquired. If the ring fails, the requests
+   * it did not complete are done with pread/pwrite.
+   * @param ring
+   *    The ring of the worker, or nullptr to use pread/pwrite
+   * @param fds
+   *    Native handle for each request, or -1 if the request already failed
+   */
+  void transfer(Uring* ring, Operation op, const std::vector<Request>& requests, const std::vector<int>& fds,
+                std::vector<Result>& results) const;
+
+  /// @return An error for a failed request
+  static std::exception_ptr makeError(Operation op, const Request& request, int err);
+};
+
+}  // end of namespace SourceXtractor
+
+#define ASYNCIO_IMPL
+#include "_impl/AsyncIO.icpp"
+#undef ASYNCIO_IMPL
+
+#endif  // POOLTESTS_ASYNCIO_H
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef POOLTESTS_BLOCKCACHE_H
+#define POOLTESTS_BLOCKCACHE_H
+
+#include "FileHandler.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace SourceXtractor {
+
+/**
+ * Cache of fixed size blocks of file content, keyed by the canonical path and the block position.
+ * @details
+ *  The blocks are split between independently locked shards, each one with its own
+ *  Least Recently Used list and its share of the memory budget.
+ *  A cache hit does not need an accessor, so it does not need a file descriptor either.
+ *  To be invalidated when a file is written, the cache must be attached to the FileManager
+ *  with FileManager::setBlockCache.
+ */
+class BlockCache {
+public:
+  using Block    = std::vector<char>;
+  using BlockPtr = std::shared_ptr<const Block>;
+
+  /**
+   * Constructor
+   * @param budget
+   *    Maximum number of bytes kept in memory
+   * @param block_size
+   *    Size of each block in bytes
+   * @param nshards
+   *    Number of shards. If 0, it will use the number of hardware threads.
+   */
+  BlockCache(std::size_t budget, std::size_t block_size = 64 * 1024, unsigned nshards = 0);
+
+  /**
+   * Read from the file, going to the cache first
+   * @tparam TFD
+   *    File descriptor type used for the blocks not in the cache
+   * @param handler
+   *    Handler of the file
+   * @param offset
+   *    Position of the first byte to read
+   * @param buffer
+   *    Output buffer
+   * @param size
+   *    Number of bytes to read
+   * @param reader
+   *    Callable as `std::size_t reader(TFD& fd, std::uint64_t offset, char* buffer, std::size_t size)`,
+   *    it must read up to size bytes at the given offset, and return how many were read. It must throw on error.
+   *    It is only called for the blocks not in the cache.
+   * @return
+   *    Number of bytes read, which is less than size only if the end of the file is reached
+   * @note
+   *    A read accessor is kept while reading the missing blocks, so no writer can modify the file
+   *    before they are in the cache. The last block of the file is not kept if it is incomplete,
+   *    since the file may grow.
+   */
+  template <typename TFD, typename Reader>
+  std::size_t read(FileHandler& handler, std::uint64_t offset, char* buffer, std::size_t size, Reader reader);
+
+  /// Forget all the blocks of a file
+  void invalidate(const boost::filesystem::path& path);
+
+  /// @return Number of bytes kept in memory
+  std::size_t getSize() const;
+
+  std::size_t getBudget() const;
+  std::size_t getBlockSize() const;
+
+private:
+  struct Key {
+    std::string   m_path;
+    std::uint64_t m_index;
+
+    bool operator==(const Key& other) const {
+      return m_index == other.m_index && m_path == other.m_path;
+    }
+  };
+
+  struct KeyHash {
+    std::size_t operator()(const Key& key) const;
+  };
+
+  struct Entry {
+    Key      m_key;
+    BlockPtr m_block;
+  };
+
+  struct Shard {
+    mutable std::mutex m_mutex;
+    /// Sorted from more to less recent
+    std::list<Entry>                                              m_entries;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> m_index;
+    std::size_t                                                   m_size = 0;
+
+    /// Blocks in the cache of the paths that fall on this shard, whichever shard holds them, so a file
+    /// can be invalidated without a scan. Guarded by m_paths_mutex, which is taken after m_mutex
+    std::mutex                                                        m_paths_mutex;
+    std::unordered_map<std::string, std::unordered_set<std::uint64_t>> m_paths;
+  };
+
+  std::size_t                         m_budget, m_block_size;
+  std::vector<std::unique_ptr<Shard>> m_shards;
+
+  Shard& getShard(const Key& key);
+
+  /// @return The shard that keeps the list of blocks of the path
+  Shard& getPathShard(const std::string& path);
+
+  /// Add or remove a block from the list of blocks of its path
+  void addToPath(const Key& key);
+  void removeFromPath(const Key& key);
+
+  BlockPtr lookup(const Key& key);
+
+  /// Insert the block, evicting the least recently used ones of the shard if needed
+  void insert(const Key& key, BlockPtr block);
+};
+
+}  // end of namespace SourceXtractor
+
+#define BLOCKCACHE_IMPL
+#include "_impl/BlockCache.icpp"
+#undef BLOCKCACHE_IMPL
+
+#endif  // POOLTESTS_BLOCKCACHE_H
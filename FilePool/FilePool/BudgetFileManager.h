@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef POOLTESTS_BUDGETFILEMANAGER_H
+#define POOLTESTS_BUDGETFILEMANAGER_H
+
+#include "LRUFileManager.h"
+
+namespace SourceXtractor {
+
+/**
+ * Least Recently Used strategy for the FileManager, limiting both the number of open files and
+ * the sum of their costs, whichever is hit first.
+ * @details
+ *  The cost of a descriptor is reported by OpenCloseTrait::cost (i.e. the bytes of its buffers).
+ *  Descriptor types that do not declare it cost nothing, and only count towards the number of files.
+ *
+ *  The room in the budget is made before opening, for the cost estimated by OpenCloseTrait::expectedCost,
+ *  and corrected once the actual cost is known. If the files in use do not leave enough room, opening
+ *  is handled as if the limit was reached, so the budget is never exceeded by the files handed out.
+ *  To make room in the budget, the costliest of the four least recently used files is closed, so one
+ *  expensive descriptor is evicted rather than many cheap ones.
+ *
+ *  Otherwise, it behaves as LRUFileManager, including the quotas of the groups.
+ */
+class BudgetFileManager final : public LRUFileManager {
+public:
+  /**
+   * Constructor
+   * @param limit
+   *    Limit on the number of open files. If 0, it will query the system to obtain the configured limit.
+   * @param budget
+   *    Limit on the sum of the costs of the open files
+   */
+  BudgetFileManager(unsigned limit, std::size_t budget);
+  virtual ~BudgetFileManager();
+
+  using LRUFileManager::getBudget;
+  using LRUFileManager::getCost;
+};
+
+}  // end of namespace SourceXtractor
+
+#endif  // POOLTESTS_BUDGETFILEMANAGER_H
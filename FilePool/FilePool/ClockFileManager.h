@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef POOLTESTS_CLOCKFILEMANAGER_H
+#define POOLTESTS_CLOCKFILEMANAGER_H
+
+#include "FileManager.h"
+
+namespace SourceXtractor {
+
+/**
+ * CLOCK (second chance) strategy for the FileManager
+ * @details
+ *  Approximates LRU: notifyUsed only sets the reference bit of the file, without locking.
+ *  When a file needs to be closed, the hand sweeps the ring of open files clearing the
+ *  reference bits, and the first file found without it is asked to close.
+ */
+class ClockFileManager final : public FileManager {
+public:
+  /**
+   * Constructor
+   * @param limit
+   *    Limit on the number of open files. If 0, it will query the system to obtain the configured limit.
+   */
+  ClockFileManager(unsigned limit = 0);
+  virtual ~ClockFileManager();
+
+  void notifyUsed(FileId id) override;
+
+  unsigned getLimit() const;
+  unsigned getUsed() const;
+  unsigned getAvailable() const;
+
+protected:
+  void notifyIntentToOpen(bool write, unsigned count) override;
+  void notifyOpenedFile(FileId id) override;
+  void notifyClosedFile(FileId id) override;
+  void notifyOpenFailed(bool write) override;
+
+private:
+  unsigned m_limit;
+
+  /// Circular list, linked through FileMetadata. New files are inserted just behind the hand
+  FileId m_hand;
+  /// Opened files plus those being opened, so concurrent openings can not go over the limit
+  unsigned m_used;
+
+  /// Ask the owner of the first file found without the reference bit to close it
+  bool closeOldest(std::unique_lock<std::mutex>& lock);
+};
+
+}  // end of namespace SourceXtractor
+
+#endif  // POOLTESTS_CLOCKFILEMANAGER_H
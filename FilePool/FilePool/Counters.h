@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef POOLTESTS_COUNTERS_H
+#define POOLTESTS_COUNTERS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace SourceXtractor {
+
+/**
+ * Monotonic counter that can be updated concurrently and sampled at any time.
+ * @details
+ *  Each counter is padded to a full cache line, so threads updating different counters
+ *  do not contend. Updates are relaxed: a snapshot of several counters is not a consistent
+ *  picture at a single instant, but each value is exact.
+ */
+class Counter {
+public:
+  Counter() : m_value(0) {}
+
+  Counter(const Counter&) = delete;
+  Counter& operator=(const Counter&) = delete;
+
+  void add(std::uint64_t n = 1) {
+    m_value.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  /// Raise the value to v, if lower
+  void max(std::uint64_t v) {
+    std::uint64_t current = m_value.load(std::memory_order_relaxed);
+    while (current < v && !m_value.compare_exchange_weak(current, v, std::memory_order_relaxed)) {
+    }
+  }
+
+  std::uint64_t get() const {
+    return m_value.load(std::memory_order_relaxed);
+  }
+
+private:
+  static constexpr std::size_t kCacheLine = 64;
+
+  std::atomic<std::uint64_t> m_value;
+  // Padding instead of alignas, since over-aligned types are not honored by new before C++17
+  char m_padding[kCacheLine - sizeof(std::atomic<std::uint64_t>)];
+};
+
+/**
+ * Distribution of durations, with buckets growing in powers of two
+ * @details
+ *  Bucket 0 holds durations below 2 ns, and bucket i those in [2^i, 2^(i+1)) ns.
+ *  The last one also holds everything longer.
+ */
+class LatencyHistogram {
+public:
+  /// The last bucket starts at about 18 minutes
+  static constexpr unsigned kBuckets = 41;
+
+  LatencyHistogram();
+
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  void record(std::chrono::nanoseconds duration);
+
+  /// @return A snapshot of the number of durations in each bucket
+  std::vector<std::uint64_t> getCounts() const;
+
+  /// @return The shortest duration that goes past the bucket
+  static std::chrono::nanoseconds upperBound(unsigned bucket);
+
+private:
+  std::atomic<std::uint64_t> m_counts[kBuckets];
+};
+
+/**
+ * Snapshot of the counters of one FileHandler, or the sum over several of them
+ */
+struct HandlerCounters {
+  /// Accessors handed out, including upgradable ones as writes
+  std::uint64_t m_read_acquired = 0, m_write_acquired = 0;
+  /// Accessors not handed out because the file was locked and kTry was given
+  std::uint64_t m_try_failed = 0;
+  /// Descriptors opened
+  std::uint64_t m_opened = 0;
+  /// Accessors served with a descriptor already opened
+  std::uint64_t m_reused = 0;
+  /// Descriptors closed at the request of the FileManager
+  std::uint64_t m_forced_closes = 0;
+  /// Time spent blocked on the file lock
+  std::chrono::nanoseconds m_lock_wait = std::chrono::nanoseconds::zero();
+
+  HandlerCounters& operator+=(const HandlerCounters& other);
+};
+
+/**
+ * Snapshot of the counters of a FileManager
+ */
+struct ManagerCounters {
+  /// Files closed to make room for others
+  std::uint64_t m_evictions = 0;
+  /// Requests to close a file refused by its handler, because it was in use
+  std::uint64_t m_refused_closes = 0;
+  /// Openings that failed because the limit was reached and nothing could be closed
+  std::uint64_t m_limit_reached = 0;
+  /// Maximum number of files open at the same time
+  std::uint64_t m_peak_used = 0;
+  /// Sum over the handlers, alive or already destroyed
+  HandlerCounters m_handlers;
+};
+
+}  // end of namespace SourceXtractor
+
+#endif  // POOLTESTS_COUNTERS_H
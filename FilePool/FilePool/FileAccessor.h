@@ -20,6 +20,8 @@
 #define POOLTESTS_FILEACCESSOR_H
 
 #include <boost/thread/shared_mutex.hpp>
+#include <functional>
+#include <vector>
 
 namespace SourceXtractor {
 
@@ -40,6 +42,36 @@ public:
   virtual bool isReadOnly() const = 0;
 };
 
+/**
+ * Class-specific allocation that keeps the memory of destroyed instances for reuse, so creating
+ * accessors in a loop does not go through the allocator.
+ * @tparam T
+ *  Concrete class, all allocations must be of its size
+ * @details
+ *  Each thread keeps its own free list, so no locking is needed. An instance can be released
+ *  by a thread other than the one that created it, in which case its memory moves to the
+ *  free list of the releasing thread.
+ */
+template <typename T>
+class RecycledAllocation {
+public:
+  static void* operator new(std::size_t size);
+  static void  operator delete(void* ptr);
+
+  /// Maximum number of free blocks kept per thread
+  static constexpr std::size_t kMaxFree = 32;
+
+private:
+  struct FreeList {
+    std::vector<void*> m_blocks;
+
+    FreeList();
+    ~FreeList();
+  };
+
+  static FreeList& freeList();
+};
+
 /**
  * Wraps a file descriptor, so when the instance is destroyed, the callback is
  * called with the wrapped descriptor moved-in
@@ -53,6 +85,8 @@ template <typename TFD>
 class FileAccessor : public FileAccessorBase {
 public:
   using ReleaseDescriptorCallback = std::function<void(TFD&&)>;
+  /// Called once the lock on the file has been released, so others can acquire it
+  using UnlockedCallback = std::function<void()>;
 
   /// The wrapped file descriptor
   TFD m_fd;
@@ -64,9 +98,10 @@ public:
   virtual bool isReadOnly() const = 0;
 
 protected:
-  FileAccessor(TFD&& fd, ReleaseDescriptorCallback release_callback);
+  FileAccessor(TFD&& fd, ReleaseDescriptorCallback release_callback, UnlockedCallback unlocked_callback);
 
   ReleaseDescriptorCallback m_release_callback;
+  UnlockedCallback          m_unlocked_callback;
 };
 
 /**
@@ -80,10 +115,11 @@ protected:
  *  What is shared is the *file* itself.
  */
 template <typename TFD>
-class FileReadAccessor : public FileAccessor<TFD> {
+class FileReadAccessor : public FileAccessor<TFD>, public RecycledAllocation<FileReadAccessor<TFD>> {
 public:
   typedef FileAccessor<TFD> Base_;
   using ReleaseDescriptorCallback = typename Base_::ReleaseDescriptorCallback;
+  using UnlockedCallback          = typename Base_::UnlockedCallback;
   using SharedLock                = typename Base_::SharedLock;
 
   /**
@@ -94,8 +130,11 @@ public:
    *    Callback to be called at destruction
    * @param lock
    *    Shared lock
+   * @param unlocked_callback
+   *    Optional callback to be called at destruction, after the lock is released
    */
-  FileReadAccessor(TFD&& fd, ReleaseDescriptorCallback release_callback, SharedLock lock);
+  FileReadAccessor(TFD&& fd, ReleaseDescriptorCallback release_callback, SharedLock lock,
+                   UnlockedCallback unlocked_callback = nullptr);
 
   /// It can not be copied
   FileReadAccessor(const FileReadAccessor&) = delete;
@@ -120,10 +159,11 @@ private:
  *  File descriptor type
  */
 template <typename TFD>
-class FileWriteAccessor : public FileAccessor<TFD> {
+class FileWriteAccessor : public FileAccessor<TFD>, public RecycledAllocation<FileWriteAccessor<TFD>> {
 public:
   typedef FileAccessor<TFD> Base_;
   using ReleaseDescriptorCallback = typename Base_::ReleaseDescriptorCallback;
+  using UnlockedCallback          = typename Base_::UnlockedCallback;
   using SharedLock                = typename Base_::SharedLock;
   using UniqueLock                = typename Base_::UniqueLock;
 
@@ -135,8 +175,11 @@ public:
    *    Callback to be called at destruction
    * @param lock
    *    Unique lock to the underlying file
+   * @param unlocked_callback
+   *    Optional callback to be called at destruction, after the lock is released
    */
-  FileWriteAccessor(TFD&& fd, ReleaseDescriptorCallback release_callback, UniqueLock lock);
+  FileWriteAccessor(TFD&& fd, ReleaseDescriptorCallback release_callback, UniqueLock lock,
+                    UnlockedCallback unlocked_callback = nullptr);
 
   /// Destructor
   virtual ~FileWriteAccessor();
@@ -148,6 +191,56 @@ private:
   UniqueLock m_unique_lock;
 };
 
+/**
+ * Wraps a file descriptor opened for writing together with an upgradable lock, so it can coexist
+ * with read accessors, and be promoted to exclusive access when it needs to write.
+ * @tparam TFD
+ *  File descriptor type
+ * @details
+ *  There can only be one upgradable accessor at a time, and no write accessor meanwhile.
+ *  Upgrading keeps the same descriptor, so its position and buffers are preserved.
+ */
+template <typename TFD>
+class FileUpgradableAccessor : public FileAccessor<TFD>, public RecycledAllocation<FileUpgradableAccessor<TFD>> {
+public:
+  typedef FileAccessor<TFD> Base_;
+  using ReleaseDescriptorCallback = typename Base_::ReleaseDescriptorCallback;
+  using UnlockedCallback          = typename Base_::UnlockedCallback;
+  using UpgradeLock               = typename Base_::UpgradeLock;
+  using UniqueLock                = typename Base_::UniqueLock;
+  using UpgradeCallback           = std::function<void()>;
+
+  /**
+   * Constructor
+   * @param fd
+   *    File descriptor, opened for writing
+   * @param release_callback
+   *    Callback to be called at destruction
+   * @param lock
+   *    Upgradable lock to the underlying file
+   * @param upgrade_callback
+   *    Callback to be called once the exclusive lock is acquired
+   * @param unlocked_callback
+   *    Optional callback to be called at destruction, after the lock is released
+   */
+  FileUpgradableAccessor(TFD&& fd, ReleaseDescriptorCallback release_callback, UpgradeLock lock,
+                         UpgradeCallback upgrade_callback, UnlockedCallback unlocked_callback = nullptr);
+
+  /// Destructor
+  virtual ~FileUpgradableAccessor();
+
+  /// @return true until upgraded
+  bool isReadOnly() const final;
+
+  /// Acquire exclusive access, waiting for the read accessors to be released
+  void upgrade();
+
+private:
+  UpgradeLock     m_upgrade_lock;
+  UniqueLock      m_unique_lock;
+  UpgradeCallback m_upgrade_callback;
+};
+
 }  // end of namespace SourceXtractor
 
 #define FILEACCESSOR_IMPL
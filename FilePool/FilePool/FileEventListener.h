@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef POOLTESTS_FILEEVENTLISTENER_H
+#define POOLTESTS_FILEEVENTLISTENER_H
+
+#include <boost/filesystem/path.hpp>
+#include <chrono>
+
+namespace SourceXtractor {
+
+/**
+ * Receives the events of a FileManager, for tracing or monitoring.
+ * @details
+ *  The methods are called from the thread that caused the event, possibly from several threads at once.
+ *  They do nothing by default, so a listener only needs to override the events it is interested on.
+ *  The mutex of the manager is never held, but each event documents the locks of the handlers that are.
+ * @warning
+ *  Since the thread may hold the lock of one or more files, a listener must not get accessors, nor
+ *  anything else that may open or close files, from the same manager. Doing so can deadlock.
+ */
+class FileEventListener {
+public:
+  using Duration = std::chrono::nanoseconds;
+
+  virtual ~FileEventListener() = default;
+
+  /// A file has been opened, which took duration.
+  /// The thread holds the lock of the file, and of any other file acquired together with it by getAccessors
+  virtual void onOpen(const boost::filesystem::path& /*path*/, bool /*write*/, Duration /*duration*/) {}
+
+  /// A file has been closed, which took duration.
+  /// The thread holds the mutex of the handler of the file. If the file was evicted, it also holds
+  /// the locks held by whoever triggered the eviction, and if the handler is switching between read
+  /// and write mode, the exclusive lock of the file
+  virtual void onClose(const boost::filesystem::path& /*path*/, Duration /*duration*/) {}
+
+  /// The manager asks the handler of a file to close it, to make room for others.
+  /// The thread holds the lock of the files it is opening, but none of the file being evicted
+  virtual void onEvictionRequest(const boost::filesystem::path& /*path*/) {}
+
+  /// The handler did not close the file, since it is in use. The same locks as for onEvictionRequest are held
+  virtual void onEvictionRefused(const boost::filesystem::path& /*path*/) {}
+
+  /// An accessor had to wait for the lock of the file for duration. The thread holds that lock
+  virtual void onLockWait(const boost::filesystem::path& /*path*/, Duration /*duration*/) {}
+};
+
+}  // end of namespace SourceXtractor
+
+#endif  // POOLTESTS_FILEEVENTLISTENER_H
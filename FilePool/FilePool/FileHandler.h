@@ -21,8 +21,19 @@
 
 #include "FileAccessor.h"
 #include "FileManager.h"
+#include <atomic>
 #include <boost/filesystem/path.hpp>
+#include <deque>
+#include <exception>
+#include <future>
 #include <list>
+#include <memory>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define FILEPOOL_HAS_COROUTINES
+#endif
 
 namespace SourceXtractor {
 
@@ -35,10 +46,28 @@ namespace SourceXtractor {
  * not* close a file being accessed, so it should just refuse to do so and let the FileManager
  * figure it out.
  */
-class FileHandler {
+class FileHandler : public std::enable_shared_from_this<FileHandler> {
 public:
-  /// Open modes
-  enum Mode { kRead = 0, kWrite = 1, kTry = 2, kTryRead = kTry, kTryWrite = kTry | kWrite };
+  /// Open modes. kUpdate writes without truncating, if a descriptor has to be opened (see OpenCloseTrait)
+  enum Mode {
+    kRead      = 0,
+    kWrite     = 1,
+    kTry       = 2,
+    kTryRead   = kTry,
+    kTryWrite  = kTry | kWrite,
+    kUpdate    = 4 | kWrite,
+    kTryUpdate = kTry | kUpdate
+  };
+
+  /// Access hints, passed to the descriptor type as POSIX_FADV_* (see OpenCloseTrait)
+  enum Hint { kNormal = 0, kSequential, kRandom, kWillNeed, kDontNeed };
+
+  /// A file and the mode of the accessor requested for it, for getAccessors
+  using SetRequest = std::pair<std::shared_ptr<FileHandler>, Mode>;
+
+  /// Receives the accessor requested with getAccessorAsync, or the error if it could not be opened
+  template <typename TFD>
+  using AccessorCallback = std::function<void(std::unique_ptr<FileAccessor<TFD>>, std::exception_ptr)>;
 
   /// Destructor
   virtual ~FileHandler();
@@ -46,51 +75,406 @@ public:
   /**
    * Get a new FileAccessor
    * @param mode
-   *    The accessor mode. TryRead and TryWrite can be used if the caller does not want to block.
+   *    The accessor mode. TryRead, TryWrite and TryUpdate can be used if the caller does not want to block.
+   * @param hint
+   *    kNormal, kSequential and kRandom set the access pattern of the descriptor, which is kept until
+   *    an accessor with a different one reuses it. kWillNeed asks to read the whole file ahead when the
+   *    accessor is created, and kDontNeed to drop it from the page cache when the accessor is released.
+   * @return
+   *    A new file accessor
+   * @throws
+   *    If opening the file fails
+   */
+  template <typename TFD>
+  std::unique_ptr<FileAccessor<TFD>> getAccessor(Mode mode = kRead, Hint hint = kNormal);
+
+  /**
+   * Get accessors on several files at once
+   * @param requests
+   *    Handlers and accessor modes. kTry is ignored. All the handlers must belong to the same FileManager,
+   *    and each one can only appear once.
+   * @return
+   *    One accessor per request, in the same order
+   * @throws Elements::Exception
+   *    If the request is not valid, or opening any of the files fails. In that case, nothing is kept.
+   * @details
+   *    The locks are taken in the order of the paths, so two sets with files in common can not deadlock.
+   *    The descriptors already opened are taken before making room for the rest, which is done in a
+   *    single pass per group of files, so acquiring a member of the set never closes another one.
+   *    If there is no room right away, and the manager is configured to wait, the descriptors are given
+   *    back before waiting, so two sets waiting for room can not hold it from each other. The room is then
+   *    made for the whole set, which may close some of its idle members, and those are opened again.
+   */
+  template <typename TFD>
+  static std::vector<std::unique_ptr<FileAccessor<TFD>>> getAccessors(const std::vector<SetRequest>& requests);
+
+  /**
+   * Get a new FileAccessor without blocking on the lock of the file
+   * @param mode
+   *    The accessor mode. kTry is ignored.
+   * @param callback
+   *    Receives the accessor once the lock is available. Requests are served in order, so a pending
+   *    writer is not starved by readers that arrive later.
+   * @param hint
+   *    See getAccessor
+   * @details
+   *    The request is parked in the handler, and served by the thread that releases the lock that was
+   *    in the way. The callback may run on that thread, or on this one if the lock is free, so it should
+   *    be short and must not throw. If the handler is destroyed first, the callback receives an error.
+   *    Opening the descriptor is done by the thread that serves the request, so it can still block
+   *    if the FileManager is configured to wait when the limit is reached.
+   */
+  template <typename TFD>
+  void getAccessorAsync(Mode mode, AccessorCallback<TFD> callback, Hint hint = kNormal);
+
+  /// Same as above, but the accessor is delivered through a future
+  template <typename TFD>
+  std::future<std::unique_ptr<FileAccessor<TFD>>> getAccessorAsync(Mode mode = kRead, Hint hint = kNormal);
+
+#ifdef FILEPOOL_HAS_COROUTINES
+  template <typename TFD>
+  class AccessorAwaitable;
+
+  /**
+   * Same as getAccessorAsync, but to be used with co_await. The coroutine is resumed on the thread
+   * that serves the request.
+   */
+  template <typename TFD>
+  AccessorAwaitable<TFD> awaitAccessor(Mode mode = kRead, Hint hint = kNormal);
+#endif
+
+  /**
+   * Get a new FileUpgradableAccessor, which can be used to read while other read accessors exist,
+   * and then be upgraded to write without releasing the file descriptor
+   * @param try_lock
+   *    If true, return nullptr instead of blocking when there is a write or upgradable accessor
    * @return
    *    A new file accessor
    * @throws
    *    If opening the file fails
+   * @note
+   *    The file descriptor is opened with OpenCloseTrait::openUpdate, which TFD must declare, so the readers
+   *    that share the file meanwhile are not affected
+   */
+  template <typename TFD>
+  std::unique_ptr<FileUpgradableAccessor<TFD>> getUpgradableAccessor(bool try_lock = false);
+
+  /**
+   * Read ahead a range of the file on the background thread of the FileManager, so it is
+   * already in the page cache when an accessor is requested
+   * @param offset
+   *    Start of the range
+   * @param length
+   *    Length of the range. 0 means until the end of the file.
+   * @details
+   *    The background thread takes a read accessor, so it counts towards the limit of the manager
+   *    and waits for the writers. The descriptor is kept by the handler, so the next accessor can
+   *    reuse it.
+   *    It does nothing if the descriptor type does not declare advise, if the handler is gone by the
+   *    time the task runs, or if the handler is in write mode then, since switching would close the
+   *    descriptor of the writer.
    */
   template <typename TFD>
-  std::unique_ptr<FileAccessor<TFD>> getAccessor(Mode mode = kRead);
+  void prefetch(off_t offset = 0, off_t length = 0);
 
   /// @return true if the handler is open in read-only mode (default)
   bool isReadOnly() const;
 
+  /// @return The canonical path of the file
+  const boost::filesystem::path& getPath() const;
+
+  /**
+   * Configure what happens to the descriptors when switching between read and write mode
+   * @param keep
+   *    If false (default), all the descriptors opened in the previous mode are closed.
+   *    If true, they are kept so they can be reused when switching back.
+   * @warning
+   *    The descriptors are not reopened, so only enable this for descriptor types that see the
+   *    changes done by others (i.e. they do not buffer the content of the file on their own)
+   */
+  void setKeepOnModeSwitch(bool keep);
+
+  /// @return A snapshot of the counters of this handler
+  HandlerCounters getCounters() const;
+
 private:
   friend class FileManager;
 
   using SharedMutex = typename FileAccessorBase::SharedMutex;
   using SharedLock  = typename FileAccessorBase::SharedLock;
   using UniqueLock  = typename FileAccessorBase::UniqueLock;
+  using UpgradeLock = typename FileAccessorBase::UpgradeLock;
 
+  /**
+   * Owns an opened file descriptor. It is kept while the descriptor is handed to an accessor,
+   * so it can be reused when it is returned.
+   */
   struct FdWrapper {
+    FileManager::FileId m_id;
+    /// Index of the free list this wrapper belongs to, one per descriptor type and mode
+    unsigned m_type;
+    /// True while the descriptor is on the free list
+    bool m_available;
+    /// For shareable descriptors, which stay on the free list, number of accessors using it
+    unsigned m_shares;
+    /// Access pattern last given to the descriptor
+    Hint m_hint;
+    /// Free list links
+    FdWrapper *m_prev, *m_next;
+
+    FdWrapper(FileManager::FileId id, unsigned type)
+        : m_id(id), m_type(type), m_available(false), m_shares(0), m_hint(kNormal), m_prev(nullptr), m_next(nullptr) {}
+
     virtual ~FdWrapper() = default;
 
+    /// @return true if no accessor is using the descriptor, so it can be closed
+    bool isIdle() const {
+      return m_available && m_shares == 0;
+    }
+
+    /// @return true if the descriptor was opened for writing
+    bool isWrite() const {
+      return m_type % 2;
+    }
+
     virtual void close() = 0;
   };
 
   template <typename TFD>
   struct TypedFdWrapper : public FdWrapper {
-    FileManager::FileId m_id;
-    TFD                 m_fd;
-    FileManager*        m_file_manager;
+    TFD          m_fd;
+    FileManager* m_file_manager;
 
-    TypedFdWrapper(FileManager::FileId id, TFD&& fd, FileManager* manager)
-        : m_id(id), m_fd(std::move(fd)), m_file_manager(manager) {}
+    TypedFdWrapper(FileManager::FileId id, bool write, TFD&& fd, FileManager* manager)
+        : FdWrapper(id, freeListIndex<TFD>(write)), m_fd(std::move(fd)), m_file_manager(manager) {}
 
     void close() final {
       m_file_manager->close(m_id, m_fd);
     }
   };
 
-  std::mutex                                                m_handler_mutex;
-  boost::filesystem::path                                   m_path;
-  FileManager*                                              m_file_manager;
-  SharedMutex                                               m_file_mutex;
-  std::map<FileManager::FileId, std::unique_ptr<FdWrapper>> m_available_fd;
-  bool                                                      m_is_readonly;
+  /// Available descriptors of the same type, most recently returned first
+  struct FdList {
+    FdWrapper* m_head;
+
+    FdList() : m_head(nullptr) {}
+
+    void       push(FdWrapper* wrapper);
+    FdWrapper* pop();
+    void       unlink(FdWrapper* wrapper);
+  };
+
+  std::mutex              m_handler_mutex;
+  boost::filesystem::path m_path;
+  FileManager*            m_file_manager;
+  SharedMutex             m_file_mutex;
+  bool                    m_is_readonly;
+  bool                    m_keep_on_mode_switch;
+  /// Index of the group of the file in the manager
+  unsigned m_group;
+
+  /// All the descriptors opened by this handler, available or not
+  std::map<FileManager::FileId, std::unique_ptr<FdWrapper>> m_fds;
+
+  /// There can only be one descriptor opened in write mode, regardless of its type
+  FdWrapper* m_write_fd;
+
+  /// Indexed by freeListIndex
+  std::vector<FdList> m_available_fd;
+
+  /**
+   * Requests from getAccessorAsync, each one returns false if the lock is still not available.
+   * If given an error, it is delivered instead of trying.
+   */
+  std::deque<std::function<bool(std::exception_ptr)>> m_async_waiters;
+  /// So releasing an accessor can skip locking when nobody is waiting
+  std::atomic<unsigned> m_nasync_waiters;
+  /// Only one thread serves the requests at a time. The others ask it to try again
+  bool m_serving, m_serve_again;
+
+  Counter m_read_acquired, m_write_acquired, m_try_failed, m_opened, m_reused, m_forced_closes;
+  /// In nanoseconds
+  Counter m_lock_wait;
+
+  /**
+   * Lock of the file while an accessor is being built. Unless handed to the accessor, releasing it serves
+   * the pending requests of getAccessorAsync, so they are not stuck if building the accessor throws.
+   * It must be destroyed without holding m_handler_mutex.
+   */
+  template <typename TLock>
+  class FileLock {
+  public:
+    FileLock() : m_handler(nullptr) {}
+
+    explicit FileLock(FileHandler* handler) : m_handler(handler), m_lock(handler->m_file_mutex, boost::defer_lock) {}
+
+    FileLock(FileLock&& other) = default;
+
+    FileLock& operator=(FileLock&& other) {
+      unlock();
+      m_handler = other.m_handler;
+      m_lock    = std::move(other.m_lock);
+      return *this;
+    }
+
+    ~FileLock() {
+      unlock();
+    }
+
+    TLock& get() {
+      return m_lock;
+    }
+
+    /// Hand the lock over, to the accessor
+    TLock release() {
+      return std::move(m_lock);
+    }
+
+  private:
+    FileHandler* m_handler;
+    TLock        m_lock;
+
+    void unlock() {
+      if (m_lock.owns_lock()) {
+        m_lock.unlock();
+        m_handler->notifyUnlocked();
+      }
+    }
+  };
+
+  /// Lock the file, accounting the time spent blocked
+  template <typename TLock>
+  void lockFile(TLock& lock);
+
+  /// Try to serve the pending requests of getAccessorAsync, in order
+  void serveAsyncWaiters();
+
+  /// Called once a lock of the file is released, to serve the pending requests if there are any
+  void notifyUnlocked();
+
+  /// Passed to the accessors, so they serve the pending requests after releasing their lock
+  std::function<void()> unlockedCallback();
+
+  /// @return A different index for each descriptor type, assigned on first use
+  template <typename TFD>
+  static unsigned typeIndex() {
+    static const unsigned index = nextTypeIndex();
+    return index;
+  }
+
+  static unsigned nextTypeIndex();
+
+  /// Even for read, odd for write
+  template <typename TFD>
+  static unsigned freeListIndex(bool write) {
+    return typeIndex<TFD>() * 2 + write;
+  }
+
+  template <typename TFD>
+  FdList& availableFd(bool write) {
+    auto index = freeListIndex<TFD>(write);
+    if (index >= m_available_fd.size()) {
+      m_available_fd.resize(index + 1);
+    }
+    return m_available_fd[index];
+  }
+
+  /// Close all the descriptors. They must be available, and the caller must hold m_handler_mutex
+  void closeAllFd();
+
+  /// Close one descriptor. It must be available
+  void closeFd(FdWrapper* wrapper);
+
+  /// Switch to read or write mode, closing the descriptors of the previous one unless configured otherwise
+  void switchMode(bool write);
+
+  /**
+   * Take an available descriptor, without opening. The caller must hold m_handler_mutex, and exclude
+   * other writers if write is true.
+   * @return
+   *    nullptr if there is none
+   */
+  template <typename TFD>
+  TypedFdWrapper<TFD>* takeFd(bool write);
+
+  /**
+   * Open a new descriptor. The caller must hold m_handler_mutex, which is released meanwhile.
+   * @param reserved
+   *    True if the slot was already reserved on the manager
+   * @param update
+   *    True to open for writing without truncating
+   */
+  template <typename TFD>
+  TypedFdWrapper<TFD>* openFd(std::unique_lock<std::mutex>& this_lock, bool write, bool reserved, bool update);
+
+  /// Notify the manager that a descriptor is handed to an accessor. The caller must hold m_handler_mutex
+  template <typename TFD>
+  void markAcquired(TypedFdWrapper<TFD>* wrapper);
+
+  /// Give back a descriptor marked as acquired, but never handed to an accessor
+  void releaseUnused(FdWrapper* wrapper);
+
+  /**
+   * Take an available descriptor for writing, or open one. The caller must hold m_handler_mutex,
+   * which is released while opening, and exclude other writers.
+   */
+  template <typename TFD>
+  TypedFdWrapper<TFD>* acquireWriteFd(std::unique_lock<std::mutex>& this_lock, bool update);
+
+  /// Build a write accessor. The caller must hold m_handler_mutex
+  template <typename TFD>
+  std::unique_ptr<FileAccessor<TFD>> makeAccessor(TypedFdWrapper<TFD>* wrapper, UniqueLock unique_lock, Hint hint);
+
+  /// Build a read accessor with its own descriptor. The caller must hold m_handler_mutex
+  template <typename TFD>
+  std::unique_ptr<FileAccessor<TFD>> makeAccessor(TypedFdWrapper<TFD>* wrapper, SharedLock shared_lock, Hint hint,
+                                                  std::false_type shareable);
+
+  /// Build a read accessor with a copy of a descriptor shared by all readers. The caller must hold m_handler_mutex
+  template <typename TFD>
+  std::unique_ptr<FileAccessor<TFD>> makeAccessor(TypedFdWrapper<TFD>* wrapper, SharedLock shared_lock, Hint hint,
+                                                  std::true_type shareable);
+
+  template <typename TFD>
+  using ReleaseCallback = typename FileAccessor<TFD>::ReleaseDescriptorCallback;
+
+  /// Build the callback of an accessor that gives back its own descriptor
+  template <typename TFD>
+  ReleaseCallback<TFD> releaseCallback(TypedFdWrapper<TFD>* wrapper, Hint hint, std::false_type shareable);
+
+  /// Build the callback of an accessor that uses a copy of a shared descriptor
+  template <typename TFD>
+  ReleaseCallback<TFD> releaseCallback(TypedFdWrapper<TFD>* wrapper, Hint hint, std::true_type shareable);
+
+  /// Put back a descriptor returned by an accessor, and notify the manager
+  template <typename TFD>
+  void release(TypedFdWrapper<TFD>* wrapper, TFD&& fd);
+
+  /// Forget the cached content of the file, after it has been written
+  void invalidateCache();
+
+  /// Release a shareable descriptor, and notify the manager if this was the last accessor using it
+  void releaseShared(FdWrapper* wrapper);
+
+  /// Give the hint of a new accessor to the descriptor it is going to use. The caller must hold m_handler_mutex
+  template <typename TFD>
+  static void adviseAcquired(TypedFdWrapper<TFD>* wrapper, Hint hint);
+
+  template <typename TFD>
+  static void advise(TFD& fd, Hint hint, off_t offset, off_t length) {
+    advise(fd, hint, offset, length, HasAdvise<TFD>());
+  }
+
+  template <typename TFD>
+  static void advise(TFD& fd, Hint hint, off_t offset, off_t length, std::true_type) {
+    OpenCloseTrait<TFD>::advise(fd, toAdvice(hint), offset, length);
+  }
+
+  template <typename TFD>
+  static void advise(TFD&, Hint, off_t, off_t, std::false_type) {}
+
+  /// @return The POSIX_FADV_* equivalent to the hint
+  static int toAdvice(Hint hint);
 
   /**
    * Constructor
@@ -100,8 +484,10 @@ private:
    *    FileManager implementation responsible for opening/closing and keeping track of
    *    number of opened files. A FileHandler could survive the manager as long as no new
    *    accessors are needed.
+   * @param group
+   *    Index of the group of the file in the manager
    */
-  FileHandler(const boost::filesystem::path& path, FileManager* file_manager);
+  FileHandler(const boost::filesystem::path& path, FileManager* file_manager, unsigned group = 0);
 
   /**
    * This is to be used by the FileManager to request the closing of a file descriptor
@@ -112,11 +498,22 @@ private:
    */
   bool close(FileManager::FileId id);
 
+  /**
+   * Same as getAccessor, but without accounting in the counters a lock that is not free, so it can be used
+   * to retry internally
+   */
+  template <typename TFD>
+  std::unique_ptr<FileAccessor<TFD>> acquireAccessor(Mode mode, Hint hint);
+
   template <typename TFD>
-  std::unique_ptr<FileAccessor<TFD>> getWriteAccessor(bool try_lock);
+  std::unique_ptr<FileAccessor<TFD>> getWriteAccessor(bool try_lock, Hint hint, bool update);
 
+  /**
+   * @param switch_mode
+   *    If false, and the handler is in write mode, return nullptr instead of closing the write descriptors
+   */
   template <typename TFD>
-  std::unique_ptr<FileAccessor<TFD>> getReadAccessor(bool try_lock);
+  std::unique_ptr<FileAccessor<TFD>> getReadAccessor(bool try_lock, Hint hint, bool switch_mode = true);
 };
 
 }  // end of namespace SourceXtractor
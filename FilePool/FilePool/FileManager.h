@@ -19,20 +19,55 @@
 #ifndef POOLTESTS_FILEMANAGER_H
 #define POOLTESTS_FILEMANAGER_H
 
+#include "Counters.h"
+#include "FileEventListener.h"
+#include <atomic>
 #include <boost/filesystem/path.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <list>
 #include <map>
 #include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace SourceXtractor {
 
 // Forward declaration
 class FileHandler;
+class BlockCache;
 
 /**
  * This trait has to be implemented for all supported file descriptor types.
  * @tparam TFD
  *  File descriptor type
+ * @details
+ *  Optionally, the specialization can declare `static constexpr bool kShareable = true` if
+ *  the same descriptor can be used by several readers at the same time (i.e. they only use
+ *  positional I/O as pread). In that case, TFD must be copyable, and each read accessor gets a copy.
+ *
+ *  It can also declare `static void advise(TFD& fd, int advice, off_t offset, off_t length)`, where
+ *  advice is one of POSIX_FADV_*, to receive the access hints given to the FileHandler. A length of 0
+ *  means until the end of the file. Without it, the hints are ignored.
+ *
+ *  To be used with AsyncIO, it must declare `static int nativeHandle(const TFD& fd)`.
+ *
+ *  If the descriptor holds resources besides itself (i.e. buffers), it can declare
+ *  `static std::size_t cost(const TFD& fd)` for the policies that limit them, and
+ *  `static std::size_t expectedCost(const boost::filesystem::path& path, bool write)` to estimate it
+ *  before opening, so the room can be made beforehand. Without an estimate, it is made once opened.
+ *
+ *  open is free to truncate the file when opening for writing. To modify a file in place, as done by
+ *  FileHandler::getUpgradableAccessor, FileHandler::kUpdate and AsyncIO writes, it must declare
+ *  `static TFD openUpdate(const boost::filesystem::path& path)`, which opens for reading and writing,
+ *  creating the file if it does not exist, but keeping its content.
  */
 template <typename TFD>
 struct OpenCloseTrait {
@@ -44,9 +79,65 @@ struct OpenCloseTrait {
   }
 };
 
+/**
+ * true_type if OpenCloseTrait<TFD> declares kShareable as true
+ */
+template <typename TFD, typename = void>
+struct IsShareable : std::false_type {};
+
+template <typename TFD>
+struct IsShareable<TFD, decltype(void(OpenCloseTrait<TFD>::kShareable))>
+    : std::integral_constant<bool, OpenCloseTrait<TFD>::kShareable> {};
+
+/**
+ * true_type if OpenCloseTrait<TFD> declares advise
+ */
+template <typename TFD, typename = void>
+struct HasAdvise : std::false_type {};
+
+template <typename TFD>
+struct HasAdvise<TFD, decltype(OpenCloseTrait<TFD>::advise(std::declval<TFD&>(), 0, off_t(), off_t()))>
+    : std::true_type {};
+
+/**
+ * true_type if OpenCloseTrait<TFD> declares cost, returning the resources held by an open descriptor
+ * (i.e. the bytes of its buffers), for managers that limit them
+ */
+template <typename TFD, typename = void>
+struct HasCost : std::false_type {};
+
+template <typename TFD>
+struct HasCost<TFD, decltype(void(OpenCloseTrait<TFD>::cost(std::declval<const TFD&>())))> : std::true_type {};
+
+/**
+ * true_type if OpenCloseTrait<TFD> declares expectedCost
+ */
+template <typename TFD, typename = void>
+struct HasExpectedCost : std::false_type {};
+
+template <typename TFD>
+struct HasExpectedCost<TFD, decltype(void(OpenCloseTrait<TFD>::expectedCost(
+                                std::declval<const boost::filesystem::path&>(), bool())))> : std::true_type {};
+
+/**
+ * true_type if OpenCloseTrait<TFD> declares openUpdate
+ */
+template <typename TFD, typename = void>
+struct HasOpenUpdate : std::false_type {};
+
+template <typename TFD>
+struct HasOpenUpdate<TFD, decltype(void(OpenCloseTrait<TFD>::openUpdate(std::declval<const boost::filesystem::path&>())))>
+    : std::true_type {};
+
 /**
  * Provide an open/close interface to FileHandler. Concrete policies must inherit
  * this interface and implement the notify* methods.
+ * @details
+ *  The limit of every policy is a hard bound on the descriptors held by the pool: a slot is taken
+ *  by notifyIntentToOpen (or reserve) before the descriptor is opened, and only given back once it is
+ *  closed, or if opening fails. Concurrent openings, reservations and waiters woken by a release all go
+ *  through the same accounting, so none of them can go over it. When there is no room, opening
+ *  waits or throws, depending on setWaitForRelease.
  */
 class FileManager {
 public:
@@ -68,6 +159,9 @@ public:
    *    File descriptor type
    * @param path
    *    File path
+   * @param group
+   *    Name of the group the file belongs to, as given to defineGroup. Empty for the default group.
+   *    It only applies if the handler is created by this call.
    * @return
    *    A FileHandler for the given file and with the requested file descriptor type
    * @details
@@ -75,14 +169,38 @@ public:
    *    shared pointer as already in use. The FileHandler is thread-safe, so this is OK.
    *    The path is normalized (no symlinks and no '.' or '..'), so this holds true even if
    *    the same file is specified in different manners.
+   *    Existing files are also identified by their device and inode numbers, so hardlinks and bind
+   *    mounts of the same file share the handler, with the path of the first one used.
+   *    The resolution of an absolute path is remembered while its handler is alive, so repeated
+   *    lookups do not touch the file system.
    * @warning
-   *    The above is *not* true for hardlinks. If the same file is referenced by different paths that
-   *    are hardlinks to the same file, it will return different handlers, so there will be no read/write
-   *    protection in place.
+   *    A file that does not exist yet can only be identified by its path. If it is created through
+   *    the handler, a hardlink to it made afterwards will still get a different handler.
    * @throws Elements::Exception
    *    If there is already a FileHandler with a *different* file descriptor type.
    */
-  std::shared_ptr<FileHandler> getFileHandler(const boost::filesystem::path& path);
+  std::shared_ptr<FileHandler> getFileHandler(const boost::filesystem::path& path,
+                                              const std::string&             group = std::string());
+
+  /**
+   * Define a group of files with its own quota of the limit, or change the quota of an existing one
+   * @param name
+   *    Name to be given to getFileHandler. Empty to change the quota of the default group.
+   * @param min
+   *    While the group has no more than min files open, they are not closed to make room for other groups
+   * @param max
+   *    Maximum number of files of the group open at the same time. 0 means no maximum besides the limit.
+   * @throws Elements::Exception
+   *    If min is greater than max
+   * @details
+   *    What is left of the limit once the minimums are granted is split evenly between the groups with
+   *    files open. When a file has to be closed, a group at its maximum or above its share closes its own;
+   *    otherwise, the policy takes it from the groups above their share, then from those above their minimum,
+   *    and only from the group of the file being opened if there is no other choice.
+   * @warning
+   *    Only honored by LRUFileManager. The other policies treat every file the same.
+   */
+  void defineGroup(const std::string& name, unsigned min, unsigned max = 0);
 
   /**
    * Open a file
@@ -96,13 +214,40 @@ public:
    *    The manager will call this function when it needs to close the file descriptor,
    *    so whoever called open can put everything in order. The callback can return "false" if the given
    *    FileId can not be closed (i.e. it is still in use). The callback is responsible for calling close.
+   * @param reserved
+   *    True if the slot was already made with reserve
+   * @param group
+   *    Index of the group the file belongs to
+   * @param update
+   *    If true, write must be true too, and the file is opened with OpenCloseTrait::openUpdate, so its
+   *    content is kept
    * @return
    *    A pair FileId, FileDescriptor
    * @note
    *    An specialization of OpenCloseTrait must exists for TFD.
    */
   template <typename TFD>
-  std::pair<FileId, TFD> open(const boost::filesystem::path& path, bool write, std::function<bool(FileId)> request_close);
+  std::pair<FileId, TFD> open(const boost::filesystem::path& path, bool write, std::function<bool(FileId)> request_close,
+                              bool reserved = false, unsigned group = 0, bool update = false);
+
+  /**
+   * Make room for several files in a single pass, so they can be opened without closing each other.
+   * Each slot must be used by a call to open with reserved set to true, or given back with cancelReservation.
+   * Until then, the slots count towards the limit.
+   * @throws Elements::Exception
+   *    If there is no room, in which case nothing is reserved
+   */
+  void reserve(bool write, unsigned count, unsigned group = 0);
+
+  /**
+   * Same as reserve, but never waits for a file to be released, even if configured to
+   * @return
+   *    false if there is no room, in which case nothing is reserved
+   */
+  bool tryReserve(bool write, unsigned count, unsigned group = 0);
+
+  /// Give back reserved slots of the group that are not going to be used
+  void cancelReservation(bool write, unsigned count, unsigned group = 0);
 
   /**
    * Close a file
@@ -118,12 +263,86 @@ public:
    */
   virtual void notifyUsed(FileId id);
 
+  /**
+   * Notify that the given file has been handed to an accessor, so it can not be closed until released.
+   * By default, this is the same as notifyUsed.
+   */
+  virtual void notifyAcquired(FileId id);
+
+  /**
+   * Notify that the given file is not in use anymore, so it could be closed if needed
+   */
+  virtual void notifyReleased(FileId id);
+
+  /**
+   * Notify that an accessor had to wait for the lock of the file
+   */
+  void notifyLockWait(const boost::filesystem::path& path, std::chrono::nanoseconds duration);
+
   /**
    * @return
    *    True if the path has an associated handler
    */
   bool hasHandler(const boost::filesystem::path& path) const;
 
+  /**
+   * Configure what happens when the limit is reached and all the files are in use
+   * @param wait
+   *    If true, opening a file will wait until some other is released or closed. Waiters are served
+   *    in arrival order: while any is waiting, newcomers queue behind it instead of taking the room freed.
+   *    If false (default), opening a file will throw.
+   * @param timeout
+   *    Maximum time to wait before throwing. Zero means forever.
+   */
+  void setWaitForRelease(bool wait, std::chrono::milliseconds timeout = std::chrono::milliseconds::zero());
+
+  /**
+   * Attach a block cache, so the handlers invalidate the blocks of their file when a write accessor is released
+   * @warning
+   *    It must be called before any handler is used
+   */
+  void setBlockCache(std::shared_ptr<BlockCache> cache);
+
+  /// @return The attached block cache, if any
+  const std::shared_ptr<BlockCache>& getBlockCache() const;
+
+  /**
+   * Run a task on a background thread owned by the manager, which is started on first use.
+   * The tasks run one after the other, in the order they were queued.
+   * @details
+   *    This is meant for work that only helps performance, as prefetching, so exceptions thrown
+   *    by the task are ignored, and the pending tasks are dropped when the manager is destroyed.
+   */
+  void runInBackground(std::function<void()> task);
+
+  /// @return A snapshot of the counters of the manager, and the sum of those of its handlers
+  ManagerCounters getCounters() const;
+
+  /**
+   * Install a listener for the events of this manager and its handlers
+   * @warning
+   *    It must be called before any handler is used
+   */
+  void setEventListener(std::shared_ptr<FileEventListener> listener);
+
+  /**
+   * Enable the latency histograms. They are disabled by default, so opening and closing do not read the
+   * clock unless something uses the time taken: the histograms, or an event listener.
+   * @warning
+   *    It must be called before any handler is used
+   */
+  void setLatencyHistograms(bool enable);
+
+  /// @return Time taken by OpenCloseTrait::open, if the histograms are enabled
+  const LatencyHistogram& getOpenLatency() const;
+
+  /// @return Time taken by OpenCloseTrait::close, if the histograms are enabled
+  const LatencyHistogram& getCloseLatency() const;
+
+  /// @return Time the accessors waited for the lock of their file, only counting those that had to,
+  ///         if the histograms are enabled
+  const LatencyHistogram& getLockWaitLatency() const;
+
 protected:
   using Clock     = std::chrono::steady_clock;
   using Timestamp = Clock::time_point;
@@ -131,27 +350,285 @@ protected:
   mutable std::mutex m_mutex;
 
   /**
-   * Map path / handler
-   * @details
-   *    The value is a std::weak_ptr because we are not really interested on keeping a handler
-   *    alive if no one is using it. However, if someone has a handler pointing to a file alive,
-   *    and someone else wants a handler to the same file, it should get the same handler.
+   * Map a file id to its metadata
    */
-  std::map<boost::filesystem::path, std::weak_ptr<FileHandler>> m_handlers;
+  std::map<FileId, std::unique_ptr<FileMetadata>> m_files;
 
   /**
-   * Map a file id to its metadata
+   * Doubly linked list of files, threaded through the links of FileMetadata,
+   * so policies can keep their book-keeping without allocating.
+   * @note
+   *    A file can only be part of one list at a time
    */
-  std::map<FileId, std::unique_ptr<FileMetadata>> m_files;
+  struct FileList {
+    FileId   m_head, m_tail;
+    unsigned m_size;
+
+    FileList() : m_head(nullptr), m_tail(nullptr), m_size(0) {}
+
+    void pushBack(FileId id);
+    void unlink(FileId id);
+
+    /// Move the file to the back of the list
+    void touch(FileId id);
+  };
+
+  /// Updated by the concrete policies
+  Counter m_evictions, m_refused_closes, m_limit_reached;
+
+  /**
+   * Ask the owner of a file to close it, accounting for the outcome
+   * @param lock
+   *    Lock guarding the book-keeping of the policy, released while the owner is closing the file,
+   *    since it may call back into the policy. The metadata may be gone once released.
+   * @param id
+   *    File to be closed
+   * @return
+   *    true if the file was closed
+   */
+  bool requestClose(std::unique_lock<std::mutex>& lock, FileId id);
+
+  /**
+   * Take an idle file out of its list and ask its owner to close it
+   * @details
+   *    The file is considered in use until released, so it is not picked again meanwhile.
+   *    If it closes, it is gone anyway. For policies that keep only the idle files in their lists,
+   *    normally the first attempt succeeds. It can still be refused if the file has just been opened,
+   *    and the handler has not acquired it yet.
+   * @param lock
+   *    Lock guarding list, released while the owner is closing the file
+   * @param list
+   *    List holding the file
+   * @param id
+   *    File to be closed
+   * @return
+   *    true if the file was closed
+   */
+  bool evict(std::unique_lock<std::mutex>& lock, FileList& list, FileId id);
 
   /// @warning
   ///     Concrete implementations *must* call this on their destructors. Otherwise the FileHandlers will
   ///     be destroyed after they are gone
   void closeAll();
 
-  virtual void notifyIntentToOpen(bool write) = 0;
-  virtual void notifyOpenedFile(FileId)       = 0;
-  virtual void notifyClosedFile(FileId)       = 0;
+  /// Quota of a group of files, and how many slots its files take, kept by the policies that honor the quotas
+  struct FileGroup {
+    unsigned m_min, m_max, m_used;
+  };
+
+  /// Indexed by group, the first one is the default group, without quota. Guarded by m_mutex
+  std::vector<FileGroup> m_groups;
+
+  /**
+   * Make room for count files that are about to be opened, all of them or none.
+   * The slots granted must count towards the limit from then on, until the file is closed, or given back
+   * with notifyOpenFailed, so concurrent openings can not go over it.
+   * @throws Elements::Exception
+   *    If there is no room. Use limitReached once it is clear there will not be any
+   */
+  virtual void notifyIntentToOpen(bool write, unsigned count) = 0;
+
+  /// Same, for files of the given group. By default, the group is ignored
+  virtual void notifyGroupIntentToOpen(bool write, unsigned count, unsigned /*group*/) {
+    notifyIntentToOpen(write, count);
+  }
+  virtual void notifyOpenedFile(FileId) = 0;
+
+  /// Called once the file is closed, and no longer in m_files, so its slot can be given back
+  virtual void notifyClosedFile(FileId) = 0;
+
+  /// Called instead of notifyOpenedFile if the file could not be opened after notifyIntentToOpen,
+  /// or if a reserved slot is not used, so its slot is given back
+  virtual void notifyOpenFailed(bool /*write*/) {}
+
+  /// Same, for a file of the given group. By default, the group is ignored
+  virtual void notifyGroupOpenFailed(bool write, unsigned /*group*/) {
+    notifyOpenFailed(write);
+  }
+
+  /**
+   * Make room for the cost (see OpenCloseTrait) of a file of the group that is about to be opened, or that
+   * turned out to cost more than expected. As notifyIntentToOpen, the cost granted must count from then on,
+   * until the file is closed (for FileMetadata::m_cost) or it is given back with notifyChargeReturned.
+   * By default, costs are not limited.
+   * @throws Elements::Exception
+   *    If there is no room
+   */
+  virtual void notifyIntentToCharge(std::size_t /*cost*/, unsigned /*group*/) {}
+
+  /// Give back a cost granted by notifyIntentToCharge, since the file cost less than expected or was not opened
+  virtual void notifyChargeReturned(std::size_t /*cost*/) {}
+
+  /**
+   * For concrete policies, take room for the files about to be opened, closing others or waiting
+   * for them to be released as configured. Throws with limitReached if there is no room.
+   * @param lock
+   *    Lock on m_mutex
+   * @param take
+   *    Take the room if there is enough, returning true, or return false otherwise
+   * @param close_one
+   *    Close an idle file, returning true, or return false if there is none
+   * @details
+   *    Only tries right away if nobody is waiting. Otherwise, or if there is no room, it queues, and only
+   *    the first in the queue tries again whenever a file is released or closed, keeping its place until
+   *    served, so the room freed is not taken by a newcomer.
+   */
+  void makeRoom(std::unique_lock<std::mutex>& lock, const std::function<bool()>& take,
+                const std::function<bool()>& close_one);
+
+  /// @return true if someone is queued in makeRoom. It can be checked without holding m_mutex
+  bool hasWaiters() const;
+
+  /**
+   * For concrete policies, throw once there is no room and waiting did not help,
+   * accounting it unless it comes from tryReserve
+   */
+  [[noreturn]] void limitReached();
+
+private:
+  struct Waiter {
+    std::condition_variable m_cv;
+    bool                    m_woken = false;
+  };
+
+  /// Device and inode numbers of a file
+  using Inode = std::pair<dev_t, ino_t>;
+
+  struct InodeHash {
+    std::size_t operator()(const Inode& inode) const;
+  };
+
+  struct Registration {
+    std::weak_ptr<FileHandler> m_handler;
+    /// Only set if the file existed when the handler was created
+    bool  m_has_inode = false;
+    Inode m_inode;
+    /// Paths, as given by the callers, that resolved to this one
+    std::vector<std::string> m_aliases;
+  };
+
+  /**
+   * Handlers and path resolutions, split between independently locked shards
+   * @details
+   *    The handler is a std::weak_ptr because we are not really interested on keeping a handler
+   *    alive if no one is using it. However, if someone has a handler pointing to a file alive,
+   *    and someone else wants a handler to the same file, it should get the same handler.
+   *    A handler lives on the shard of its normalized path, an alias on the shard of the
+   *    path as given, and an inode on the shard of its hash. At most one m_mutex is locked at a time,
+   *    and m_inode_mutex is never taken while holding one.
+   */
+  struct RegistryShard {
+    mutable std::mutex m_mutex;
+    /// Normalized path / handler
+    std::unordered_map<std::string, Registration> m_handlers;
+    /// Path as given / normalized path of the handler, kept while the handler is registered
+    std::unordered_map<std::string, std::string> m_aliases;
+
+    /// Held while looking up and registering a handler by inode, so two hardlinks can not race
+    mutable std::mutex m_inode_mutex;
+    /// Inode / normalized path of the handler. Guarded by m_mutex
+    std::unordered_map<Inode, std::string, InodeHash> m_inodes;
+  };
+
+  std::vector<std::unique_ptr<RegistryShard>> m_registry;
+
+  Counter m_peak_used;
+
+  /// Name / index in m_groups. Guarded by m_mutex
+  std::map<std::string, unsigned> m_group_index;
+
+  LatencyHistogram m_open_latency, m_close_latency, m_lock_wait_latency;
+  bool             m_record_latency;
+
+  /// Null if there is none, so the hooks cost a single branch
+  std::shared_ptr<FileEventListener> m_listener;
+
+  /// Sum of the counters of the handlers already destroyed
+  mutable std::mutex m_counters_mutex;
+  HandlerCounters    m_retired_counters;
+
+  std::shared_ptr<BlockCache> m_block_cache;
+
+  /// Guarded by m_background_mutex
+  std::mutex                        m_background_mutex;
+  std::condition_variable           m_background_cv;
+  std::deque<std::function<void()>> m_background_tasks;
+  std::thread                       m_background_thread;
+  bool                              m_background_stop;
+
+  bool                      m_wait_for_release;
+  std::chrono::milliseconds m_wait_timeout;
+
+  /// Guarded by m_mutex. The atomic count allows notifyReleased to skip locking when nobody is waiting
+  std::list<Waiter*>    m_waiters;
+  std::atomic<unsigned> m_nwaiters;
+
+  RegistryShard& getRegistryShard(const std::string& path) const;
+  RegistryShard& getRegistryShard(const Inode& inode) const;
+
+  /// @return The normalized path, or an empty string if it is not known yet
+  std::string lookupAlias(const std::string& path) const;
+
+  /// @return The live handler registered for the normalized path, if any
+  std::shared_ptr<FileHandler> lookupHandler(const std::string& canonical) const;
+
+  /// @return The live handler registered for the file, if any, and still pointing to it
+  std::shared_ptr<FileHandler> lookupInode(const Inode& inode, std::string& canonical) const;
+
+  /// Remember that the path resolves to the handler registered as canonical
+  void addAlias(const std::string& path, const std::string& canonical);
+
+  /// @return The live handler registered as canonical, or a new one in the group if there is none
+  std::shared_ptr<FileHandler> registerHandler(const std::string& path, const std::string& canonical,
+                                               const Inode* inode, unsigned group);
+
+  /// @return The index in m_groups of the named group
+  unsigned getGroupIndex(const std::string& group) const;
+
+  /// Remove the registration of a handler that has been destroyed, and the aliases that resolved to it
+  void unregister(const std::string& canonical);
+
+  /// @return The cost declared by OpenCloseTrait<TFD>, or 0 if it does not declare one
+  template <typename TFD>
+  static std::size_t descriptorCost(const TFD& fd, std::true_type) {
+    return OpenCloseTrait<TFD>::cost(fd);
+  }
+
+  template <typename TFD>
+  static std::size_t descriptorCost(const TFD&, std::false_type) {
+    return 0;
+  }
+
+  /// @return The cost estimated by OpenCloseTrait<TFD> before opening, or 0 if it does not estimate it
+  template <typename TFD>
+  static std::size_t expectedCost(const boost::filesystem::path& path, bool write, std::true_type) {
+    return OpenCloseTrait<TFD>::expectedCost(path, write);
+  }
+
+  template <typename TFD>
+  static std::size_t expectedCost(const boost::filesystem::path&, bool, std::false_type) {
+    return 0;
+  }
+
+  /// Open with OpenCloseTrait<TFD>::openUpdate if update is true, or with open otherwise
+  template <typename TFD>
+  static TFD openDescriptor(const boost::filesystem::path& path, bool write, bool update, std::true_type);
+
+  /// Throws if update is true, since there is no way of opening without truncating
+  template <typename TFD>
+  static TFD openDescriptor(const boost::filesystem::path& path, bool write, bool update, std::false_type);
+
+  /// Wake up the oldest waiter, if any
+  void wakeWaiter();
+
+  /// Same, with m_mutex held
+  void wakeFirstWaiter();
+
+  /// Body of the background thread
+  void backgroundLoop();
+
+  /// Drop the pending background tasks, and wait for the running one
+  void stopBackground();
 };
 
 }  // end of namespace SourceXtractor
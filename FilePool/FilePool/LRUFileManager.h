@@ -20,38 +20,122 @@
 #define POOLTESTS_LRUFILEMANAGER_H
 
 #include "FileManager.h"
+#include <condition_variable>
+#include <thread>
 
 namespace SourceXtractor {
 
 /**
  * Least Recently Used strategy for the FileManager
+ * @details
+ *  Optionally, a background thread can close the least recently used files whenever the number
+ *  of open files goes above a watermark, so opening a file does not need to wait for another to be closed.
+ *
+ *  The quotas of the groups given to FileManager::defineGroup are honored: a group at its maximum, or that
+ *  would go above its fair share, closes its own least recently used file. Otherwise, the file closed is
+ *  the least recently used of those belonging to a group above its share, or else above its minimum,
+ *  or to the group of the file being opened if there are none.
+ *
+ *  Derived policies can also limit the sum of the costs of the open files (see BudgetFileManager).
  */
-class LRUFileManager final : public FileManager {
+class LRUFileManager : public FileManager {
 public:
   /**
    * Constructor
    * @param limit
    *    Limit on the number of open files. If 0, it will query the system to obtain the configured limit.
+   * @param watermark
+   *    If not 0, a background thread will keep the number of open files at or below this value.
+   *    It must be lower than the limit. The files that are in use are not closed, so the limit still applies.
    */
-  LRUFileManager(unsigned limit = 0);
+  LRUFileManager(unsigned limit = 0, unsigned watermark = 0);
   virtual ~LRUFileManager();
 
   void notifyUsed(FileId id) override;
+  void notifyAcquired(FileId id) override;
+  void notifyReleased(FileId id) override;
 
   unsigned getLimit() const;
   unsigned getUsed() const;
   unsigned getAvailable() const;
 
 protected:
-  void notifyIntentToOpen(bool write) override;
+  void notifyIntentToOpen(bool write, unsigned count) override;
+  void notifyGroupIntentToOpen(bool write, unsigned count, unsigned group) override;
   void notifyOpenedFile(FileId id) override;
   void notifyClosedFile(FileId id) override;
+  void notifyOpenFailed(bool write) override;
+  void notifyGroupOpenFailed(bool write, unsigned group) override;
+  void notifyIntentToCharge(std::size_t cost, unsigned group) override;
+  void notifyChargeReturned(std::size_t cost) override;
+
+  /**
+   * Constructor for policies that also limit the costs
+   * @param limit
+   *    Limit on the number of open files. If 0, it will query the system to obtain the configured limit.
+   * @param watermark
+   *    As for the public constructor
+   * @param budget
+   *    Limit on the sum of the costs of the open files
+   */
+  LRUFileManager(unsigned limit, unsigned watermark, std::size_t budget);
+
+  std::size_t getBudget() const;
+
+  /// @return Sum of the costs of the open files
+  std::size_t getCost() const;
 
 private:
-  unsigned                                      m_limit;
-  /// Sorted from less to more recent
-  std::list<FileId>                             m_sorted_ids;
-  std::map<FileId, std::list<FileId>::iterator> m_current_pos;
+  unsigned m_limit, m_watermark;
+
+  /// Opened files plus those being opened, so concurrent openings can not go over the limit
+  unsigned m_used;
+
+  /// Sum of the costs of the open files and those being opened, and its limit
+  std::size_t m_cost, m_budget;
+
+  /// Number of least recently used files among which the costliest is closed to make room in the budget
+  static constexpr unsigned kCostWindow = 4;
+
+  /// Files not handed to any accessor, sorted from less to more recent, one list per group.
+  /// Only these are asked to close
+  std::vector<FileList> m_sorted_ids;
+
+  /// Used by the reaper, which does not open any file
+  static constexpr unsigned kNoGroup = ~0u;
+
+  /// @return The list of the group of the file
+  FileList& sortedIds(FileId id);
+
+  /// @return true if count more files of the group can be opened
+  bool hasRoom(unsigned count, unsigned group) const;
+
+  /// @return The least recently used idle file that can be closed to open count files of the group, if any
+  FileId pickVictim(unsigned group, unsigned count);
+
+  /// @return The costliest among the file and those used after it, up to kCostWindow
+  FileId costliestOf(FileId id);
+
+  std::thread             m_reaper;
+  std::condition_variable m_reaper_cv;
+  bool                    m_reaper_stop;
+
+  /**
+   * Ask the owner of the least recently used idle file that can be closed to close it
+   * @param lock
+   *    Lock on m_mutex, released while the owner is closing the file
+   * @param group
+   *    Group of the files to be opened, or kNoGroup
+   * @param count
+   *    Number of files to be opened
+   * @param by_cost
+   *    If true, the room is needed in the budget, so the costliest of the least recently used is closed
+   * @return
+   *    false if there is no file that can be closed
+   */
+  bool closeOldest(std::unique_lock<std::mutex>& lock, unsigned group, unsigned count, bool by_cost = false);
+
+  void reaperLoop();
 };
 
 }  // end of namespace SourceXtractor
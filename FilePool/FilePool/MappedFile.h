@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef POOLTESTS_MAPPEDFILE_H
+#define POOLTESTS_MAPPEDFILE_H
+
+#include "FileManager.h"
+#include <cstddef>
+
+namespace SourceXtractor {
+
+/**
+ * File descriptor type that maps the whole file in memory, so it can be accessed without copies
+ * @details
+ *  The mapping is shared, so the changes done through a writable mapping are visible to the
+ *  read-only ones, and readers share the same mapping. It counts as one file for the FileManager,
+ *  and it is unmapped when the FileManager closes it.
+ * @warning
+ *  The size is fixed when the file is mapped. Writers can not grow the file through the mapping.
+ */
+struct MappedFile {
+  /// Start of the mapping, or nullptr if the file is empty
+  char* m_data;
+  /// Size in bytes
+  std::size_t m_size;
+  /// True if the mapping can be modified. Otherwise, writing to it will crash
+  bool m_writable;
+
+  const char* begin() const {
+    return m_data;
+  }
+
+  const char* end() const {
+    return m_data + m_size;
+  }
+};
+
+template <>
+struct OpenCloseTrait<MappedFile> {
+  /// All readers can use the same mapping
+  static constexpr bool kShareable = true;
+
+  /**
+   * Map the file
+   * @param path
+   *    File path. The file must exist, and it is not truncated when mapped for writing.
+   * @param write
+   *    If true, the mapping is writable
+   * @throws Elements::Exception
+   *    If the file can not be opened or mapped
+   */
+  static MappedFile open(const boost::filesystem::path& path, bool write);
+
+  /// Map the file for writing. As open, it never truncates, and the file must exist
+  static MappedFile openUpdate(const boost::filesystem::path& path);
+
+  /// Unmap the file
+  static void close(MappedFile& mapped);
+
+  /// Translate the POSIX_FADV_* advice into madvise on the mapped range
+  static void advise(MappedFile& mapped, int advice, off_t offset, off_t length);
+
+  /// The size of the mapping
+  static std::size_t cost(const MappedFile& mapped);
+
+  /// The size of the file, which will be the size of the mapping
+  static std::size_t expectedCost(const boost::filesystem::path& path, bool write);
+};
+
+}  // end of namespace SourceXtractor
+
+#endif  // POOLTESTS_MAPPEDFILE_H
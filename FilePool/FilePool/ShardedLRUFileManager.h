@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef POOLTESTS_SHARDEDLRUFILEMANAGER_H
+#define POOLTESTS_SHARDEDLRUFILEMANAGER_H
+
+#include "FileManager.h"
+#include <atomic>
+#include <vector>
+
+namespace SourceXtractor {
+
+/**
+ * Least Recently Used strategy for the FileManager, where the book-keeping is split
+ * between several independently locked segments.
+ * @details
+ *  Each FileId is assigned to a shard by its hash, so notifyUsed only contends with the
+ *  files that fall in the same shard. The limit is global: shards do not have a budget
+ *  of their own, and the victim is the least recently used among the oldest entry of each shard.
+ *  The slots are taken on a single atomic counter, so the limit is kept exactly as by the other policies.
+ */
+class ShardedLRUFileManager final : public FileManager {
+public:
+  /**
+   * Constructor
+   * @param limit
+   *    Limit on the number of open files. If 0, it will query the system to obtain the configured limit.
+   * @param nshards
+   *    Number of shards. If 0, it will use the number of hardware threads.
+   */
+  ShardedLRUFileManager(unsigned limit = 0, unsigned nshards = 0);
+  virtual ~ShardedLRUFileManager();
+
+  void notifyUsed(FileId id) override;
+  void notifyAcquired(FileId id) override;
+  void notifyReleased(FileId id) override;
+
+  unsigned getLimit() const;
+  unsigned getUsed() const;
+  unsigned getAvailable() const;
+  unsigned getShardCount() const;
+
+protected:
+  void notifyIntentToOpen(bool write, unsigned count) override;
+  void notifyOpenedFile(FileId id) override;
+  void notifyClosedFile(FileId id) override;
+  void notifyOpenFailed(bool write) override;
+
+private:
+  struct Shard {
+    std::mutex m_mutex;
+    /// Files not handed to any accessor, sorted from less to more recent
+    FileList   m_sorted_ids;
+  };
+
+  unsigned                            m_limit;
+  std::vector<std::unique_ptr<Shard>> m_shards;
+
+  /// Opened files plus those being opened, so the limit is kept while the shards are not locked
+  std::atomic<unsigned> m_used;
+
+  Shard& getShard(FileId id);
+
+  /// Ask the owner of the least recently used idle file to close it
+  bool closeOldest();
+};
+
+}  // end of namespace SourceXtractor
+
+#endif  // POOLTESTS_SHARDEDLRUFILEMANAGER_H
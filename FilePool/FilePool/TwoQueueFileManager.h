@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef POOLTESTS_TWOQUEUEFILEMANAGER_H
+#define POOLTESTS_TWOQUEUEFILEMANAGER_H
+
+#include "FileManager.h"
+
+namespace SourceXtractor {
+
+/**
+ * 2Q strategy for the FileManager, resistant to sequential scans
+ * @details
+ *  Newly opened files enter a FIFO queue. If they are used again while there, they are promoted
+ *  to the frequent queue, which is sorted by recency. Files are evicted preferably from the FIFO queue
+ *  while it is above its share of the limit, so a pass over many files used only once does not push out
+ *  the frequently used ones.
+ *  The paths of the files evicted from the FIFO queue are remembered for a while (ghost entries). If they are
+ *  opened again during that time, they go directly into the frequent queue.
+ */
+class TwoQueueFileManager final : public FileManager {
+public:
+  /**
+   * Constructor
+   * @param limit
+   *    Limit on the number of open files. If 0, it will query the system to obtain the configured limit.
+   * @param in_ratio
+   *    Share of the limit reserved for the FIFO queue
+   * @param ghost_ratio
+   *    Number of evicted paths to remember, relative to the limit
+   */
+  TwoQueueFileManager(unsigned limit = 0, double in_ratio = 0.25, double ghost_ratio = 0.5);
+  virtual ~TwoQueueFileManager();
+
+  void notifyUsed(FileId id) override;
+
+  unsigned getLimit() const;
+  unsigned getUsed() const;
+  unsigned getAvailable() const;
+
+protected:
+  void notifyIntentToOpen(bool write, unsigned count) override;
+  void notifyOpenedFile(FileId id) override;
+  void notifyClosedFile(FileId id) override;
+  void notifyOpenFailed(bool write) override;
+
+private:
+  enum Queue { kIn = 0, kFrequent = 1 };
+
+  unsigned m_limit, m_in_limit, m_ghost_limit;
+
+  /// Opened files plus those being opened, so concurrent openings can not go over the limit
+  unsigned m_used;
+
+  /// Files used only once since they were opened, in opening order
+  FileList m_in;
+  /// Files used more than once, sorted from less to more recent
+  FileList m_frequent;
+
+  /// Paths recently evicted from m_in, and their position on the FIFO
+  std::list<boost::filesystem::path>                                               m_ghost;
+  std::map<boost::filesystem::path, std::list<boost::filesystem::path>::iterator> m_ghost_pos;
+
+  void remember(const boost::filesystem::path& path);
+
+  /// Ask the owner of the first candidate for eviction to close it
+  bool closeOldest(std::unique_lock<std::mutex>& lock);
+};
+
+}  // end of namespace SourceXtractor
+
+#endif  // POOLTESTS_TWOQUEUEFILEMANAGER_H
@@ -0,0 +1,420 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/AsyncIO.h"
+#include "AlexandriaKernel/memory_tools.h"
+#include "ElementsKernel/Exception.h"
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <sched.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FILEPOOL_HAS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace SourceXtractor {
+
+#ifdef FILEPOOL_HAS_IO_URING
+
+/**
+ * Minimal io_uring wrapper, using the system calls directly so there is no dependency on liburing.
+ * It is only used by one worker thread, so there is no locking.
+ */
+class AsyncIO::Uring {
+public:
+  explicit Uring(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (m_fd < 0) {
+      throw Elements::Exception() << "Failed to setup io_uring: " << strerror(errno);
+    }
+    m_capacity = params.sq_entries;
+
+    m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+    single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+#endif
+    if (single_mmap) {
+      m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+    }
+
+    m_sq_ptr = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ptr == MAP_FAILED) {
+      int err = errno;
+      ::close(m_fd);
+      throw Elements::Exception() << "Failed to map the io_uring submission queue: " << strerror(err);
+    }
+    if (single_mmap) {
+      m_cq_ptr = m_sq_ptr;
+    } else {
+      m_cq_ptr = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+      if (m_cq_ptr == MAP_FAILED) {
+        int err = errno;
+        munmap(m_sq_ptr, m_sq_size);
+        ::close(m_fd);
+        throw Elements::Exception() << "Failed to map the io_uring completion queue: " << strerror(err);
+      }
+    }
+
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes  = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      int err = errno;
+      unmapRings();
+      ::close(m_fd);
+      throw Elements::Exception() << "Failed to map the io_uring submission entries: " << strerror(err);
+    }
+    m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+    auto sq     = static_cast<char*>(m_sq_ptr);
+    m_sq_head   = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    m_sq_tail   = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sq_mask   = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sq_array  = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    auto cq     = static_cast<char*>(m_cq_ptr);
+    m_cq_head   = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_cq_tail   = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cq_mask   = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    m_cqes      = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    m_prepared  = 0;
+    m_broken    = false;
+  }
+
+  ~Uring() {
+    munmap(m_sqes, m_sqes_size);
+    unmapRings();
+    ::close(m_fd);
+  }
+
+  /// @return How many requests can be prepared before submitting
+  unsigned capacity() const {
+    return m_capacity;
+  }
+
+  /// @return true if submitting failed, so the ring must not be used again
+  bool isBroken() const {
+    return m_broken;
+  }
+
+  /// Queue a vectored read or write. It is not seen by the kernel until submitAndWait
+  void prepare(uint8_t opcode, int fd, const iovec* iov, off_t offset, uint64_t user_data) {
+    assert(m_prepared < m_capacity);
+    unsigned tail  = *m_sq_tail + m_prepared;
+    unsigned index = tail & m_sq_mask;
+
+    io_uring_sqe& sqe = m_sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode    = opcode;
+    sqe.fd        = fd;
+    sqe.addr      = reinterpret_cast<uint64_t>(iov);
+    sqe.len       = 1;
+    sqe.off       = offset;
+    sqe.user_data = user_data;
+
+    m_sq_array[index] = index;
+    ++m_prepared;
+  }
+
+  /**
+   * Submit the prepared requests, and wait for all of them
+   * @param on_complete
+   *    Called with the user data and the result of each request
+   * @throws Elements::Exception
+   *    If the kernel refuses the submission. The requests it had already taken are completed before,
+   *    since they reference the buffers of the caller, and the others are withdrawn. The ring is broken.
+   */
+  void submitAndWait(const std::function<void(uint64_t, int)>& on_complete) {
+    unsigned first    = *m_sq_tail;
+    unsigned expected = m_prepared;
+    // The kernel must see the entries before the new tail
+    __atomic_store_n(m_sq_tail, first + m_prepared, __ATOMIC_RELEASE);
+
+    unsigned to_submit = m_prepared;
+    m_prepared         = 0;
+    unsigned completed = 0;
+    while (completed < expected) {
+      int ret = static_cast<int>(
+          syscall(__NR_io_uring_enter, m_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+      if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+          continue;
+        int err = errno;
+        abandon(first, completed, on_complete);
+        throw Elements::Exception() << "io_uring_enter failed: " << strerror(err);
+      }
+      to_submit -= std::min<unsigned>(to_submit, ret);
+      completed += reap(on_complete);
+    }
+  }
+
+private:
+  int           m_fd;
+  unsigned      m_capacity, m_prepared;
+  bool          m_broken;
+  void *        m_sq_ptr, *m_cq_ptr;
+  std::size_t   m_sq_size, m_cq_size, m_sqes_size;
+  io_uring_sqe* m_sqes;
+  unsigned *    m_sq_head, *m_sq_tail, *m_sq_array, *m_cq_head, *m_cq_tail;
+  unsigned      m_sq_mask, m_cq_mask;
+  io_uring_cqe* m_cqes;
+
+  /// Pass the available completions to the callback
+  unsigned reap(const std::function<void(uint64_t, int)>& on_complete) {
+    unsigned head  = *m_cq_head;
+    unsigned tail  = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = tail - head;
+    for (; head != tail; ++head) {
+      const io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+      on_complete(cqe.user_data, cqe.res);
+    }
+    __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+  /**
+   * Leave the ring without requests in flight after a failed submission
+   * @param first
+   *    Position on the submission queue of the first entry of the submission
+   * @param completed
+   *    Number of its entries completed so far, updated
+   */
+  void abandon(unsigned first, unsigned& completed, const std::function<void(uint64_t, int)>& on_complete) {
+    m_broken = true;
+
+    // Without SQPOLL, the kernel only takes entries within io_uring_enter, so the rest can be withdrawn
+    unsigned taken = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(m_sq_tail, taken, __ATOMIC_RELEASE);
+
+    // The kernel posts the completions even if waiting for them fails
+    while (completed < taken - first) {
+      int ret = static_cast<int>(syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+      if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        sched_yield();
+      }
+      completed += reap(on_complete);
+    }
+  }
+
+  void unmapRings() {
+    munmap(m_sq_ptr, m_sq_size);
+    if (m_cq_ptr != m_sq_ptr) {
+      munmap(m_cq_ptr, m_cq_size);
+    }
+  }
+};
+
+#else
+
+/// io_uring is not available on this platform, so it can not be built
+class AsyncIO::Uring {
+public:
+  explicit Uring(unsigned) {
+    throw Elements::Exception() << "io_uring is not supported";
+  }
+
+  unsigned capacity() const {
+    return 0;
+  }
+
+  bool isBroken() const {
+    return false;
+  }
+
+  void prepare(uint8_t, int, const iovec*, off_t, uint64_t) {}
+
+  void submitAndWait(const std::function<void(uint64_t, int)>&) {}
+};
+
+#endif
+
+/**
+ * Do a positional read or write until done, the end of the file, or an error
+ * @return
+ *    The number of bytes transferred, or -errno
+ */
+static ssize_t transferAll(AsyncIO::Operation op, int fd, char* buffer, std::size_t length, off_t offset) {
+  std::size_t done = 0;
+  while (done < length) {
+    ssize_t ret;
+    if (op == AsyncIO::kRead) {
+      ret = ::pread(fd, buffer + done, length - done, offset + done);
+    } else {
+      ret = ::pwrite(fd, buffer + done, length - done, offset + done);
+    }
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (ret == 0)
+      break;
+    done += ret;
+  }
+  return done;
+}
+
+AsyncIO::AsyncIO(unsigned nthreads, unsigned queue_depth, bool use_uring)
+    : m_use_uring(use_uring), m_queue_depth(std::max(1u, queue_depth)), m_stop(false) {
+  // If the kernel does not support it, or it is forbidden, fall back to pread/pwrite
+  if (m_use_uring) {
+    try {
+      Uring probe(1);
+    } catch (...) {
+      m_use_uring = false;
+    }
+  }
+  if (nthreads == 0) {
+    nthreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (unsigned i = 0; i < nthreads; ++i) {
+    m_workers.emplace_back(&AsyncIO::workerLoop, this);
+  }
+}
+
+AsyncIO::~AsyncIO() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+    m_cv.notify_all();
+  }
+  for (auto& worker : m_workers) {
+    worker.join();
+  }
+}
+
+bool AsyncIO::usesUring() const {
+  return m_use_uring;
+}
+
+void AsyncIO::enqueue(Batch batch) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_batches.emplace_back(std::move(batch));
+  m_cv.notify_one();
+}
+
+void AsyncIO::workerLoop() {
+  // Each worker has its own ring, so submitting does not need any lock
+  std::unique_ptr<Uring> ring;
+  if (m_use_uring) {
+    try {
+      ring = Euclid::make_unique<Uring>(m_queue_depth);
+    } catch (...) {
+      // This worker falls back to pread/pwrite
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true) {
+    m_cv.wait(lock, [this]() { return m_stop || !m_batches.empty(); });
+    // Pending batches are done before stopping
+    if (m_batches.empty())
+      return;
+    auto batch = std::move(m_batches.front());
+    m_batches.pop_front();
+
+    lock.unlock();
+    batch(ring.get());
+    // Falls back to pread/pwrite for the next batches
+    if (ring && ring->isBroken()) {
+      ring.reset();
+    }
+    lock.lock();
+  }
+}
+
+void AsyncIO::transfer(Uring* ring, Operation op, const std::vector<Request>& requests, const std::vector<int>& fds,
+                       std::vector<Result>& results) const {
+  std::size_t       nrequests = requests.size();
+  std::vector<bool> completed(nrequests, false);
+
+  if (ring) {
+#ifdef FILEPOOL_HAS_IO_URING
+    uint8_t opcode = (op == kRead) ? IORING_OP_READV : IORING_OP_WRITEV;
+#else
+    uint8_t opcode = 0;
+#endif
+    std::vector<iovec> iovecs(nrequests);
+    auto               on_complete = [&requests, &results, &completed, op](uint64_t index, int res) {
+      if (res < 0) {
+        results[index].m_error = makeError(op, requests[index], -res);
+      } else {
+        results[index].m_transferred = res;
+      }
+      completed[index] = true;
+    };
+
+    std::size_t next = 0;
+    while (next < nrequests) {
+      unsigned prepared = 0;
+      for (; next < nrequests && prepared < ring->capacity(); ++next) {
+        if (fds[next] < 0)
+          continue;
+        iovecs[next].iov_base = requests[next].m_buffer;
+        iovecs[next].iov_len  = requests[next].m_length;
+        ring->prepare(opcode, fds[next], &iovecs[next], requests[next].m_offset, next);
+        ++prepared;
+      }
+      if (prepared == 0)
+        continue;
+      try {
+        ring->submitAndWait(on_complete);
+      } catch (...) {
+        // Nothing is in flight anymore, so what was not completed is done below without the ring
+        break;
+      }
+    }
+  }
+
+  // Do here what the ring did not, and complete the short transfers, unless they reached the end of the file
+  for (std::size_t i = 0; i < nrequests; ++i) {
+    auto& request = requests[i];
+    auto& result  = results[i];
+    if (fds[i] < 0 || result.m_error || result.m_transferred == request.m_length)
+      continue;
+    if (completed[i] && result.m_transferred == 0)
+      continue;
+
+    ssize_t ret = transferAll(op, fds[i], request.m_buffer + result.m_transferred,
+                              request.m_length - result.m_transferred, request.m_offset + result.m_transferred);
+    if (ret < 0) {
+      result.m_error = makeError(op, request, -ret);
+    } else {
+      result.m_transferred += ret;
+    }
+  }
+}
+
+std::exception_ptr AsyncIO::makeError(Operation op, const Request& request, int err) {
+  return std::make_exception_ptr(Elements::Exception()
+                                 << "Failed to " << (op == kRead ? "read " : "write ") << request.m_length << " bytes at "
+                                 << request.m_offset << " of " << request.m_handler->getPath() << ": " << strerror(err));
+}
+
+}  // end of namespace SourceXtractor
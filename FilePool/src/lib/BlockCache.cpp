@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/BlockCache.h"
+#include "AlexandriaKernel/memory_tools.h"
+#include <thread>
+
+namespace SourceXtractor {
+
+BlockCache::BlockCache(std::size_t budget, std::size_t block_size, unsigned nshards)
+    : m_budget(budget), m_block_size(block_size) {
+  assert(m_block_size > 0);
+  if (nshards == 0) {
+    nshards = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (unsigned i = 0; i < nshards; ++i) {
+    m_shards.emplace_back(Euclid::make_unique<Shard>());
+  }
+}
+
+std::size_t BlockCache::KeyHash::operator()(const Key& key) const {
+  return std::hash<std::string>()(key.m_path) ^ (key.m_index * 0x9E3779B97F4A7C15ull);
+}
+
+auto BlockCache::getShard(const Key& key) -> Shard& {
+  return *m_shards[KeyHash()(key) % m_shards.size()];
+}
+
+auto BlockCache::getPathShard(const std::string& path) -> Shard& {
+  return *m_shards[std::hash<std::string>()(path) % m_shards.size()];
+}
+
+void BlockCache::addToPath(const Key& key) {
+  auto&                       shard = getPathShard(key.m_path);
+  std::lock_guard<std::mutex> lock(shard.m_paths_mutex);
+  shard.m_paths[key.m_path].insert(key.m_index);
+}
+
+void BlockCache::removeFromPath(const Key& key) {
+  auto&                       shard = getPathShard(key.m_path);
+  std::lock_guard<std::mutex> lock(shard.m_paths_mutex);
+  auto                        iter = shard.m_paths.find(key.m_path);
+  if (iter == shard.m_paths.end())
+    return;
+  iter->second.erase(key.m_index);
+  if (iter->second.empty())
+    shard.m_paths.erase(iter);
+}
+
+auto BlockCache::lookup(const Key& key) -> BlockPtr {
+  auto&                       shard = getShard(key);
+  std::lock_guard<std::mutex> lock(shard.m_mutex);
+  auto                        iter = shard.m_index.find(key);
+  if (iter == shard.m_index.end())
+    return nullptr;
+  // Bring it to the front, since it is the last used
+  shard.m_entries.splice(shard.m_entries.begin(), shard.m_entries, iter->second);
+  return iter->second->m_block;
+}
+
+void BlockCache::insert(const Key& key, BlockPtr block) {
+  auto&                       shard        = getShard(key);
+  std::size_t                 shard_budget = m_budget / m_shards.size();
+  std::lock_guard<std::mutex> lock(shard.m_mutex);
+
+  // Someone else may have read it meanwhile
+  if (shard.m_index.count(key))
+    return;
+
+  shard.m_size += block->size();
+  shard.m_entries.push_front(Entry{key, std::move(block)});
+  shard.m_index.emplace(key, shard.m_entries.begin());
+  addToPath(key);
+
+  // Readers may still hold the evicted blocks, but those are released when they are done
+  while (shard.m_size > shard_budget && !shard.m_entries.empty()) {
+    auto& last = shard.m_entries.back();
+    shard.m_size -= last.m_block->size();
+    removeFromPath(last.m_key);
+    shard.m_index.erase(last.m_key);
+    shard.m_entries.pop_back();
+  }
+}
+
+void BlockCache::invalidate(const boost::filesystem::path& path) {
+  // Called whenever a write accessor is released, so a file without blocks must be cheap
+  std::unordered_set<std::uint64_t> indexes;
+  {
+    auto&                       path_shard = getPathShard(path.native());
+    std::lock_guard<std::mutex> lock(path_shard.m_paths_mutex);
+    auto                        iter = path_shard.m_paths.find(path.native());
+    if (iter == path_shard.m_paths.end())
+      return;
+    indexes = std::move(iter->second);
+    path_shard.m_paths.erase(iter);
+  }
+
+  // The writer still holds the lock of the file, so no reader can insert its blocks meanwhile
+  Key key{path.native(), 0};
+  for (auto index : indexes) {
+    key.m_index = index;
+    auto&                       shard = getShard(key);
+    std::lock_guard<std::mutex> lock(shard.m_mutex);
+    auto                        iter = shard.m_index.find(key);
+    if (iter == shard.m_index.end())
+      continue;
+    shard.m_size -= iter->second->m_block->size();
+    shard.m_entries.erase(iter->second);
+    shard.m_index.erase(iter);
+  }
+}
+
+std::size_t BlockCache::getSize() const {
+  std::size_t size = 0;
+  for (auto& shard : m_shards) {
+    std::lock_guard<std::mutex> lock(shard->m_mutex);
+    size += shard->m_size;
+  }
+  return size;
+}
+
+std::size_t BlockCache::getBudget() const {
+  return m_budget;
+}
+
+std::size_t BlockCache::getBlockSize() const {
+  return m_block_size;
+}
+
+}  // end of namespace SourceXtractor
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/ClockFileManager.h"
+#include "ElementsKernel/Exception.h"
+#include <sys/resource.h>
+
+namespace SourceXtractor {
+
+ClockFileManager::ClockFileManager(unsigned limit) : m_limit(limit), m_hand(nullptr), m_used(0) {
+  if (m_limit == 0) {
+    struct rlimit rlim;
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    assert(rlim.rlim_cur > 3);
+    m_limit = rlim.rlim_cur - 3;  // Account for stdout, stderr and stdin
+  }
+}
+
+ClockFileManager::~ClockFileManager() {
+  closeAll();
+}
+
+bool ClockFileManager::closeOldest(std::unique_lock<std::mutex>& lock) {
+  // Two turns are enough to clear all reference bits and try each file once.
+  // The ones that refuse to close are in use, so they are skipped
+  bool     closed = false;
+  unsigned steps  = 2 * m_used;
+  for (; !closed && steps > 0 && m_hand; --steps) {
+    FileId id = m_hand;
+    m_hand    = m_hand->m_next;
+    if (id->m_referenced.exchange(false, std::memory_order_relaxed))
+      continue;
+    closed = requestClose(lock, id);
+  }
+  return closed;
+}
+
+void ClockFileManager::notifyIntentToOpen(bool /*write*/, unsigned count) {
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  if (count > m_limit) {
+    throw Elements::Exception() << "Can not open " << count << " files at once, the limit is " << m_limit;
+  }
+
+  auto take = [this, count]() {
+    if (m_used + count > m_limit)
+      return false;
+    m_used += count;
+    return true;
+  };
+  makeRoom(lock, take, [this, &lock]() { return closeOldest(lock); });
+}
+
+void ClockFileManager::notifyOpenedFile(FileId id) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (m_hand) {
+    id->m_next             = m_hand;
+    id->m_prev             = m_hand->m_prev;
+    m_hand->m_prev->m_next = id;
+    m_hand->m_prev         = id;
+  } else {
+    id->m_prev = id->m_next = id;
+    m_hand                  = id;
+  }
+}
+
+void ClockFileManager::notifyClosedFile(FileId id) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (id->m_next == id) {
+    m_hand = nullptr;
+  } else {
+    if (m_hand == id)
+      m_hand = id->m_next;
+    id->m_prev->m_next = id->m_next;
+    id->m_next->m_prev = id->m_prev;
+  }
+  id->m_prev = id->m_next = nullptr;
+  --m_used;
+}
+
+void ClockFileManager::notifyOpenFailed(bool /*write*/) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  --m_used;
+}
+
+void ClockFileManager::notifyUsed(FileId id) {
+  FileManager::notifyUsed(id);
+  id->m_referenced.store(true, std::memory_order_relaxed);
+}
+
+unsigned int ClockFileManager::getLimit() const {
+  return m_limit;
+}
+
+unsigned int ClockFileManager::getUsed() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_used;
+}
+
+unsigned int ClockFileManager::getAvailable() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_limit - m_used;
+}
+
+}  // end of namespace SourceXtractor
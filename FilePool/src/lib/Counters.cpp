@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/Counters.h"
+#include <algorithm>
+
+namespace SourceXtractor {
+
+constexpr unsigned LatencyHistogram::kBuckets;
+
+LatencyHistogram::LatencyHistogram() {
+  for (auto& count : m_counts) {
+    count.store(0, std::memory_order_relaxed);
+  }
+}
+
+void LatencyHistogram::record(std::chrono::nanoseconds duration) {
+  auto     ns     = static_cast<std::uint64_t>(std::max<std::chrono::nanoseconds::rep>(duration.count(), 0));
+  unsigned bucket = 0;
+  while (ns > 1 && bucket < kBuckets - 1) {
+    ns >>= 1;
+    ++bucket;
+  }
+  m_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<std::uint64_t> LatencyHistogram::getCounts() const {
+  std::vector<std::uint64_t> counts(kBuckets);
+  for (unsigned i = 0; i < kBuckets; ++i) {
+    counts[i] = m_counts[i].load(std::memory_order_relaxed);
+  }
+  return counts;
+}
+
+std::chrono::nanoseconds LatencyHistogram::upperBound(unsigned bucket) {
+  if (bucket >= kBuckets - 1)
+    return std::chrono::nanoseconds::max();
+  return std::chrono::nanoseconds(std::int64_t(2) << bucket);
+}
+
+HandlerCounters& HandlerCounters::operator+=(const HandlerCounters& other) {
+  m_read_acquired += other.m_read_acquired;
+  m_write_acquired += other.m_write_acquired;
+  m_try_failed += other.m_try_failed;
+  m_opened += other.m_opened;
+  m_reused += other.m_reused;
+  m_forced_closes += other.m_forced_closes;
+  m_lock_wait += other.m_lock_wait;
+  return *this;
+}
+
+}  // end of namespace SourceXtractor
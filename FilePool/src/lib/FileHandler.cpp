@@ -17,29 +17,213 @@
  */
 
 #include "FilePool/FileHandler.h"
+#include "FilePool/BlockCache.h"
+#include "ElementsKernel/Exception.h"
+#include <atomic>
+#include <fcntl.h>
 
 namespace SourceXtractor {
 
-FileHandler::FileHandler(const boost::filesystem::path& path, FileManager* file_manager)
-    : m_path(path), m_file_manager(file_manager), m_is_readonly(true) {}
+FileHandler::FileHandler(const boost::filesystem::path& path, FileManager* file_manager, unsigned group)
+    : m_path(path)
+    , m_file_manager(file_manager)
+    , m_is_readonly(true)
+    , m_keep_on_mode_switch(false)
+    , m_group(group)
+    , m_write_fd(nullptr)
+    , m_nasync_waiters(0)
+    , m_serving(false)
+    , m_serve_again(false) {}
 
 FileHandler::~FileHandler() {
-  for (auto& avail : m_available_fd) {
-    avail.second->close();
+  // Nobody can release an accessor of this handler anymore, so the pending requests would never be served
+  if (!m_async_waiters.empty()) {
+    auto error = std::make_exception_ptr(Elements::Exception() << "The handler of " << m_path << " has been destroyed");
+    for (auto& attempt : m_async_waiters) {
+      attempt(error);
+    }
   }
+  std::lock_guard<std::mutex> this_lock(m_handler_mutex);
+  closeAllFd();
 }
 
 bool FileHandler::isReadOnly() const {
   return m_is_readonly;
 }
 
+const boost::filesystem::path& FileHandler::getPath() const {
+  return m_path;
+}
+
+void FileHandler::invalidateCache() {
+  if (auto& cache = m_file_manager->getBlockCache()) {
+    cache->invalidate(m_path);
+  }
+}
+
+void FileHandler::setKeepOnModeSwitch(bool keep) {
+  std::lock_guard<std::mutex> this_lock(m_handler_mutex);
+  m_keep_on_mode_switch = keep;
+}
+
 bool FileHandler::close(FileManager::FileId id) {
   std::lock_guard<std::mutex> this_lock(m_handler_mutex);
-  auto                        iter = m_available_fd.find(id);
-  if (iter == m_available_fd.end())
+  auto                        iter = m_fds.find(id);
+  if (iter == m_fds.end() || !iter->second->isIdle())
     return false;
-  m_available_fd.erase(iter);
+  closeFd(iter->second.get());
+  m_forced_closes.add();
   return true;
 }
 
+void FileHandler::closeFd(FdWrapper* wrapper) {
+  assert(wrapper->isIdle());
+  m_available_fd[wrapper->m_type].unlink(wrapper);
+  if (wrapper == m_write_fd) {
+    m_write_fd = nullptr;
+  }
+  wrapper->close();
+  m_fds.erase(wrapper->m_id);
+}
+
+void FileHandler::closeAllFd() {
+  for (auto& fd : m_fds) {
+    assert(fd.second->isIdle());
+    fd.second->close();
+  }
+  m_fds.clear();
+  m_write_fd = nullptr;
+  for (auto& available : m_available_fd) {
+    available.m_head = nullptr;
+  }
+}
+
+void FileHandler::releaseShared(FdWrapper* wrapper) {
+  std::lock_guard<std::mutex> this_lock(m_handler_mutex);
+  assert(wrapper->m_shares > 0);
+  if (--wrapper->m_shares == 0) {
+    m_file_manager->notifyReleased(wrapper->m_id);
+  }
+}
+
+void FileHandler::notifyUnlocked() {
+  if (m_nasync_waiters > 0) {
+    serveAsyncWaiters();
+  }
+}
+
+std::function<void()> FileHandler::unlockedCallback() {
+  return [this]() { notifyUnlocked(); };
+}
+
+void FileHandler::serveAsyncWaiters() {
+  std::unique_lock<std::mutex> this_lock(m_handler_mutex);
+  if (m_serving) {
+    m_serve_again = true;
+    return;
+  }
+  m_serving = true;
+
+  do {
+    m_serve_again = false;
+    while (!m_async_waiters.empty()) {
+      auto attempt = std::move(m_async_waiters.front());
+      m_async_waiters.pop_front();
+
+      // Acquiring needs the handler mutex, and the callback may use the handler
+      this_lock.unlock();
+      bool served = attempt(nullptr);
+      this_lock.lock();
+
+      if (!served) {
+        // Keep the order, the following ones wait behind it
+        m_async_waiters.emplace_front(std::move(attempt));
+        break;
+      }
+      --m_nasync_waiters;
+    }
+    // Something may have been released while trying
+  } while (m_serve_again);
+
+  m_serving = false;
+}
+
+void FileHandler::releaseUnused(FdWrapper* wrapper) {
+  // Shared descriptors stay on the free list while in use
+  if (wrapper->m_available) {
+    releaseShared(wrapper);
+    return;
+  }
+  std::lock_guard<std::mutex> this_lock(m_handler_mutex);
+  m_available_fd[wrapper->m_type].push(wrapper);
+  m_file_manager->notifyReleased(wrapper->m_id);
+}
+
+HandlerCounters FileHandler::getCounters() const {
+  HandlerCounters counters;
+  counters.m_read_acquired  = m_read_acquired.get();
+  counters.m_write_acquired = m_write_acquired.get();
+  counters.m_try_failed     = m_try_failed.get();
+  counters.m_opened         = m_opened.get();
+  counters.m_reused         = m_reused.get();
+  counters.m_forced_closes  = m_forced_closes.get();
+  counters.m_lock_wait      = std::chrono::nanoseconds(m_lock_wait.get());
+  return counters;
+}
+
+void FileHandler::switchMode(bool write) {
+  // The previous descriptors may have stale buffers, so by default they are not reused
+  if (!m_keep_on_mode_switch) {
+    closeAllFd();
+  }
+  m_is_readonly = !write;
+}
+
+int FileHandler::toAdvice(Hint hint) {
+  switch (hint) {
+  case kSequential:
+    return POSIX_FADV_SEQUENTIAL;
+  case kRandom:
+    return POSIX_FADV_RANDOM;
+  case kWillNeed:
+    return POSIX_FADV_WILLNEED;
+  case kDontNeed:
+    return POSIX_FADV_DONTNEED;
+  default:
+    return POSIX_FADV_NORMAL;
+  }
+}
+
+unsigned FileHandler::nextTypeIndex() {
+  static std::atomic<unsigned> counter(0);
+  return counter++;
+}
+
+void FileHandler::FdList::push(FdWrapper* wrapper) {
+  wrapper->m_available = true;
+  wrapper->m_prev      = nullptr;
+  wrapper->m_next      = m_head;
+  if (m_head)
+    m_head->m_prev = wrapper;
+  m_head = wrapper;
+}
+
+auto FileHandler::FdList::pop() -> FdWrapper* {
+  auto wrapper = m_head;
+  if (wrapper)
+    unlink(wrapper);
+  return wrapper;
+}
+
+void FileHandler::FdList::unlink(FdWrapper* wrapper) {
+  if (wrapper->m_prev)
+    wrapper->m_prev->m_next = wrapper->m_next;
+  else
+    m_head = wrapper->m_next;
+  if (wrapper->m_next)
+    wrapper->m_next->m_prev = wrapper->m_prev;
+  wrapper->m_prev = wrapper->m_next = nullptr;
+  wrapper->m_available              = false;
+}
+
 }  // namespace SourceXtractor
\ No newline at end of file
@@ -17,8 +17,11 @@
  */
 
 #include "FilePool/FileManager.h"
+#include "FilePool/BlockCache.h"
 #include "FilePool/FileHandler.h"
+#include <algorithm>
 #include <boost/filesystem/operations.hpp>
+#include <sys/stat.h>
 
 #if BOOST_VERSION < 106000
 /**
@@ -54,9 +57,21 @@ boost::filesystem::path weakly_canonical(const boost::filesystem::path& path) {
 
 namespace SourceXtractor {
 
-FileManager::FileManager() {}
+/// Set by tryReserve, so the policies do not wait for a release
+static thread_local const FileManager* s_not_waiting = nullptr;
 
-FileManager::~FileManager() {}
+FileManager::FileManager()
+    : m_record_latency(false), m_background_stop(false), m_wait_for_release(false), m_wait_timeout(0), m_nwaiters(0) {
+  unsigned nshards = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned i = 0; i < nshards; ++i) {
+    m_registry.emplace_back(Euclid::make_unique<RegistryShard>());
+  }
+  m_groups.push_back(FileGroup{0, 0, 0});
+}
+
+FileManager::~FileManager() {
+  stopBackground();
+}
 
 void FileManager::notifyUsed(FileId id) {
   // In principle a FileId should only be hold by a single thread, so no need to lock here
@@ -64,39 +79,506 @@ void FileManager::notifyUsed(FileId id) {
   ++id->m_used_count;
 }
 
+void FileManager::notifyAcquired(FileId id) {
+  notifyUsed(id);
+}
+
+void FileManager::notifyReleased(FileId /*id*/) {
+  wakeWaiter();
+}
+
+void FileManager::setWaitForRelease(bool wait, std::chrono::milliseconds timeout) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_wait_for_release = wait;
+  m_wait_timeout     = timeout;
+}
+
+void FileManager::setEventListener(std::shared_ptr<FileEventListener> listener) {
+  m_listener = std::move(listener);
+}
+
+void FileManager::setLatencyHistograms(bool enable) {
+  m_record_latency = enable;
+}
+
+const LatencyHistogram& FileManager::getOpenLatency() const {
+  return m_open_latency;
+}
+
+const LatencyHistogram& FileManager::getCloseLatency() const {
+  return m_close_latency;
+}
+
+const LatencyHistogram& FileManager::getLockWaitLatency() const {
+  return m_lock_wait_latency;
+}
+
+void FileManager::notifyLockWait(const boost::filesystem::path& path, std::chrono::nanoseconds duration) {
+  if (m_record_latency) {
+    m_lock_wait_latency.record(duration);
+  }
+  if (m_listener) {
+    m_listener->onLockWait(path, duration);
+  }
+}
+
+void FileManager::setBlockCache(std::shared_ptr<BlockCache> cache) {
+  m_block_cache = std::move(cache);
+}
+
+auto FileManager::getBlockCache() const -> const std::shared_ptr<BlockCache>& {
+  return m_block_cache;
+}
+
+void FileManager::reserve(bool write, unsigned count, unsigned group) {
+  notifyGroupIntentToOpen(write, count, group);
+}
+
+bool FileManager::tryReserve(bool write, unsigned count, unsigned group) {
+  s_not_waiting = this;
+  try {
+    notifyGroupIntentToOpen(write, count, group);
+  } catch (const Elements::Exception&) {
+    s_not_waiting = nullptr;
+    return false;
+  } catch (...) {
+    s_not_waiting = nullptr;
+    throw;
+  }
+  s_not_waiting = nullptr;
+  return true;
+}
+
+void FileManager::defineGroup(const std::string& name, unsigned min, unsigned max) {
+  if (max > 0 && min > max) {
+    throw Elements::Exception() << "The minimum of the group " << name << " is greater than its maximum";
+  }
+  std::lock_guard<std::mutex> lock(m_mutex);
+  unsigned                    index = 0;
+  if (!name.empty()) {
+    auto iter = m_group_index.find(name);
+    if (iter == m_group_index.end()) {
+      iter = m_group_index.emplace(name, m_groups.size()).first;
+      m_groups.push_back(FileGroup{0, 0, 0});
+    }
+    index = iter->second;
+  }
+  m_groups[index].m_min = min;
+  m_groups[index].m_max = max;
+}
+
+void FileManager::cancelReservation(bool write, unsigned count, unsigned group) {
+  for (unsigned i = 0; i < count; ++i) {
+    notifyGroupOpenFailed(write, group);
+  }
+  if (count > 0) {
+    wakeWaiter();
+  }
+}
+
+void FileManager::runInBackground(std::function<void()> task) {
+  std::lock_guard<std::mutex> lock(m_background_mutex);
+  if (m_background_stop)
+    return;
+  if (!m_background_thread.joinable()) {
+    m_background_thread = std::thread(&FileManager::backgroundLoop, this);
+  }
+  m_background_tasks.emplace_back(std::move(task));
+  m_background_cv.notify_one();
+}
+
+void FileManager::backgroundLoop() {
+  std::unique_lock<std::mutex> lock(m_background_mutex);
+  while (true) {
+    m_background_cv.wait(lock, [this]() { return m_background_stop || !m_background_tasks.empty(); });
+    if (m_background_stop)
+      return;
+    auto task = std::move(m_background_tasks.front());
+    m_background_tasks.pop_front();
+
+    lock.unlock();
+    try {
+      task();
+    } catch (...) {
+      // Background tasks are only an optimization
+    }
+    lock.lock();
+  }
+}
+
+void FileManager::stopBackground() {
+  {
+    std::lock_guard<std::mutex> lock(m_background_mutex);
+    m_background_stop = true;
+    m_background_tasks.clear();
+    m_background_cv.notify_one();
+  }
+  if (m_background_thread.joinable()) {
+    m_background_thread.join();
+  }
+}
+
+void FileManager::wakeWaiter() {
+  if (m_nwaiters == 0)
+    return;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  wakeFirstWaiter();
+}
+
+bool FileManager::hasWaiters() const {
+  return m_nwaiters > 0;
+}
+
+void FileManager::wakeFirstWaiter() {
+  // It stays in the queue until served, so its place is kept if there is still no room
+  if (!m_waiters.empty()) {
+    auto waiter     = m_waiters.front();
+    waiter->m_woken = true;
+    waiter->m_cv.notify_one();
+  }
+}
+
+void FileManager::makeRoom(std::unique_lock<std::mutex>& lock, const std::function<bool()>& take,
+                           const std::function<bool()>& close_one) {
+  // Only try right away if nobody is waiting, so no one is overtaken
+  bool served = false;
+  if (m_waiters.empty()) {
+    while (!(served = take()) && close_one()) {
+    }
+  }
+  if (served)
+    return;
+  if (!m_wait_for_release || s_not_waiting == this)
+    limitReached();
+
+  Waiter waiter;
+  m_waiters.push_back(&waiter);
+  ++m_nwaiters;
+
+  auto deadline = Clock::now() + m_wait_timeout;
+  auto woken    = [&waiter]() { return waiter.m_woken; };
+  bool expired  = false;
+  try {
+    while (!expired) {
+      // Only the first in the queue takes room. Cleared before trying, so a release meanwhile is not missed
+      if (m_waiters.front() == &waiter) {
+        waiter.m_woken = false;
+        while (!(served = take()) && close_one()) {
+        }
+        if (served)
+          break;
+      }
+      if (m_wait_timeout.count() > 0) {
+        expired = !waiter.m_cv.wait_until(lock, deadline, woken);
+      } else {
+        waiter.m_cv.wait(lock, woken);
+      }
+    }
+  } catch (...) {
+    m_waiters.remove(&waiter);
+    --m_nwaiters;
+    wakeFirstWaiter();
+    throw;
+  }
+
+  // Either way, the next one gets its turn: there may be room left for it too
+  m_waiters.remove(&waiter);
+  --m_nwaiters;
+  wakeFirstWaiter();
+  if (!served)
+    limitReached();
+}
+
+void FileManager::limitReached() {
+  if (s_not_waiting != this) {
+    m_limit_reached.add();
+  }
+  throw Elements::Exception() << "Limit reached and failed to close any existing file descriptor";
+}
+
+void FileManager::FileList::pushBack(FileId id) {
+  id->m_prev = m_tail;
+  id->m_next = nullptr;
+  if (m_tail)
+    m_tail->m_next = id;
+  else
+    m_head = id;
+  m_tail = id;
+  ++m_size;
+}
+
+void FileManager::FileList::unlink(FileId id) {
+  if (id->m_prev)
+    id->m_prev->m_next = id->m_next;
+  else
+    m_head = id->m_next;
+  if (id->m_next)
+    id->m_next->m_prev = id->m_prev;
+  else
+    m_tail = id->m_prev;
+  id->m_prev = id->m_next = nullptr;
+  --m_size;
+}
+
+void FileManager::FileList::touch(FileId id) {
+  if (id != m_tail) {
+    unlink(id);
+    pushBack(id);
+  }
+}
+
 void FileManager::closeAll() {
-  m_handlers.clear();
+  // The background tasks may be using the handlers
+  stopBackground();
+  for (auto& shard : m_registry) {
+    std::lock_guard<std::mutex> lock(shard->m_mutex);
+    shard->m_handlers.clear();
+    shard->m_aliases.clear();
+  }
 }
 
-std::shared_ptr<FileHandler> FileManager::getFileHandler(const boost::filesystem::path& path) {
-  auto canonical = weakly_canonical(path);
+std::size_t FileManager::InodeHash::operator()(const Inode& inode) const {
+  return std::hash<dev_t>()(inode.first) ^ (std::hash<ino_t>()(inode.second) * 0x9E3779B97F4A7C15ull);
+}
+
+auto FileManager::getRegistryShard(const std::string& path) const -> RegistryShard& {
+  return *m_registry[std::hash<std::string>()(path) % m_registry.size()];
+}
+
+auto FileManager::getRegistryShard(const Inode& inode) const -> RegistryShard& {
+  return *m_registry[InodeHash()(inode) % m_registry.size()];
+}
 
-  std::lock_guard<std::mutex>  lock(m_mutex);
-  auto                         i = m_handlers.find(canonical);
+/**
+ * @return true if the file exists
+ */
+static bool statInode(const std::string& path, std::pair<dev_t, ino_t>& inode) {
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0)
+    return false;
+  inode = std::make_pair(st.st_dev, st.st_ino);
+  return true;
+}
+
+std::string FileManager::lookupAlias(const std::string& path) const {
+  auto&                       shard = getRegistryShard(path);
+  std::lock_guard<std::mutex> lock(shard.m_mutex);
+  auto                        iter = shard.m_aliases.find(path);
+  if (iter == shard.m_aliases.end())
+    return std::string();
+  return iter->second;
+}
+
+std::shared_ptr<FileHandler> FileManager::lookupHandler(const std::string& canonical) const {
+  auto&                       shard = getRegistryShard(canonical);
+  std::lock_guard<std::mutex> lock(shard.m_mutex);
+  auto                        iter = shard.m_handlers.find(canonical);
+  if (iter == shard.m_handlers.end())
+    return nullptr;
+  return iter->second.m_handler.lock();
+}
+
+std::shared_ptr<FileHandler> FileManager::lookupInode(const Inode& inode, std::string& canonical) const {
+  auto& shard = getRegistryShard(inode);
+  {
+    std::lock_guard<std::mutex> lock(shard.m_mutex);
+    auto                        iter = shard.m_inodes.find(inode);
+    if (iter == shard.m_inodes.end())
+      return nullptr;
+    canonical = iter->second;
+  }
+  // The file may have been removed, and its inode reused by another one
+  Inode current;
+  if (!statInode(canonical, current) || current != inode)
+    return nullptr;
+  return lookupHandler(canonical);
+}
+
+void FileManager::addAlias(const std::string& path, const std::string& canonical) {
+  {
+    auto&                       shard = getRegistryShard(canonical);
+    std::lock_guard<std::mutex> lock(shard.m_mutex);
+    auto                        iter = shard.m_handlers.find(canonical);
+    if (iter == shard.m_handlers.end())
+      return;
+    auto& aliases = iter->second.m_aliases;
+    if (std::find(aliases.begin(), aliases.end(), path) == aliases.end())
+      aliases.push_back(path);
+  }
+  auto&                       shard = getRegistryShard(path);
+  std::lock_guard<std::mutex> lock(shard.m_mutex);
+  shard.m_aliases[path] = canonical;
+}
+
+std::shared_ptr<FileHandler> FileManager::registerHandler(const std::string& path, const std::string& canonical,
+                                                          const Inode* inode, unsigned group) {
   std::shared_ptr<FileHandler> handler_ptr;
+  {
+    auto&                       shard = getRegistryShard(canonical);
+    std::lock_guard<std::mutex> lock(shard.m_mutex);
+    auto&                       registration = shard.m_handlers[canonical];
 
-  if (i != m_handlers.end()) {
-    handler_ptr = i->second.lock();
+    handler_ptr = registration.m_handler.lock();
+    // Either didn't exist or it is gone
+    if (!handler_ptr) {
+      handler_ptr = std::shared_ptr<FileHandler>(new FileHandler(canonical, this, group), [this, canonical](FileHandler* obj) {
+        unregister(canonical);
+        {
+          std::lock_guard<std::mutex> counters_lock(m_counters_mutex);
+          m_retired_counters += obj->getCounters();
+        }
+        delete obj;
+      });
+      registration.m_handler   = handler_ptr;
+      registration.m_has_inode = false;
+      registration.m_aliases.clear();
+    }
+    if (inode) {
+      registration.m_has_inode = true;
+      registration.m_inode     = *inode;
+    }
   }
-  // Either didn't exist or it is gone
-  if (!handler_ptr) {
-    handler_ptr           = std::shared_ptr<FileHandler>(new FileHandler(canonical, this), [this, canonical](FileHandler* obj) {
-      {
-        std::lock_guard<std::mutex> manager_lock(m_mutex);
-        m_handlers.erase(canonical);
-      }
-      delete obj;
-    });
-    m_handlers[canonical] = handler_ptr;
+  addAlias(path, canonical);
+  return handler_ptr;
+}
+
+void FileManager::unregister(const std::string& canonical) {
+  Registration registration;
+  {
+    auto&                       shard = getRegistryShard(canonical);
+    std::lock_guard<std::mutex> lock(shard.m_mutex);
+    auto                        iter = shard.m_handlers.find(canonical);
+    // A new handler may have been registered for the same file after this one expired
+    if (iter == shard.m_handlers.end() || !iter->second.m_handler.expired())
+      return;
+    registration = std::move(iter->second);
+    shard.m_handlers.erase(iter);
+  }
+  if (registration.m_has_inode) {
+    auto&                       shard = getRegistryShard(registration.m_inode);
+    std::lock_guard<std::mutex> lock(shard.m_mutex);
+    auto                        iter = shard.m_inodes.find(registration.m_inode);
+    if (iter != shard.m_inodes.end() && iter->second == canonical)
+      shard.m_inodes.erase(iter);
+  }
+  // The file system may change while there is no handler, so the resolutions are not kept
+  for (auto& alias : registration.m_aliases) {
+    auto&                       shard = getRegistryShard(alias);
+    std::lock_guard<std::mutex> lock(shard.m_mutex);
+    auto                        iter = shard.m_aliases.find(alias);
+    if (iter != shard.m_aliases.end() && iter->second == canonical)
+      shard.m_aliases.erase(iter);
+  }
+}
+
+unsigned FileManager::getGroupIndex(const std::string& group) const {
+  if (group.empty())
+    return 0;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto                        iter = m_group_index.find(group);
+  if (iter == m_group_index.end()) {
+    throw Elements::Exception() << "Unknown group " << group;
+  }
+  return iter->second;
+}
+
+std::shared_ptr<FileHandler> FileManager::getFileHandler(const boost::filesystem::path& path, const std::string& group) {
+  // Relative paths depend on the working directory, so they are remembered as absolute
+  std::string key = path.is_absolute() ? path.native() : boost::filesystem::absolute(path).native();
+
+  // Fast path: already resolved, and the handler is alive
+  auto canonical = lookupAlias(key);
+  if (!canonical.empty()) {
+    if (auto handler_ptr = lookupHandler(canonical))
+      return handler_ptr;
+  }
+
+  // Resolve without holding any lock, since it hits the file system
+  canonical = weakly_canonical(boost::filesystem::path(key)).native();
+  if (auto handler_ptr = lookupHandler(canonical)) {
+    addAlias(key, canonical);
+    return handler_ptr;
+  }
+
+  // Does not exist yet, so it can only be identified by its path
+  Inode inode;
+  if (!statInode(canonical, inode)) {
+    return registerHandler(key, canonical, nullptr, getGroupIndex(group));
+  }
+
+  // Serialize the lookups of the same inode, so two hardlinks can not register two handlers
+  auto&                       inode_shard = getRegistryShard(inode);
+  std::lock_guard<std::mutex> inode_lock(inode_shard.m_inode_mutex);
+
+  std::string linked;
+  if (auto handler_ptr = lookupInode(inode, linked)) {
+    addAlias(key, linked);
+    return handler_ptr;
+  }
+
+  auto handler_ptr = registerHandler(key, canonical, &inode, getGroupIndex(group));
+  {
+    std::lock_guard<std::mutex> lock(inode_shard.m_mutex);
+    inode_shard.m_inodes[inode] = handler_ptr->getPath().native();
   }
   return handler_ptr;
 }
 
+bool FileManager::requestClose(std::unique_lock<std::mutex>& lock, FileId id) {
+  auto close_call = id->m_request_close;
+  lock.unlock();
+  bool closed = close_call();
+  lock.lock();
+  if (closed) {
+    m_evictions.add();
+  } else {
+    m_refused_closes.add();
+  }
+  return closed;
+}
+
+bool FileManager::evict(std::unique_lock<std::mutex>& lock, FileList& list, FileId id) {
+  list.unlink(id);
+  id->m_in_use = true;
+  return requestClose(lock, id);
+}
+
+ManagerCounters FileManager::getCounters() const {
+  ManagerCounters counters;
+  counters.m_evictions      = m_evictions.get();
+  counters.m_refused_closes = m_refused_closes.get();
+  counters.m_limit_reached  = m_limit_reached.get();
+  counters.m_peak_used      = m_peak_used.get();
+
+  // The handlers are sampled without holding any lock, since releasing the last reference destroys them
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& shard : m_registry) {
+    std::lock_guard<std::mutex> lock(shard->m_mutex);
+    for (auto& registration : shard->m_handlers) {
+      if (auto handler = registration.second.m_handler.lock())
+        handlers.emplace_back(std::move(handler));
+    }
+  }
+  for (auto& handler : handlers) {
+    counters.m_handlers += handler->getCounters();
+  }
+
+  std::lock_guard<std::mutex> counters_lock(m_counters_mutex);
+  counters.m_handlers += m_retired_counters;
+  return counters;
+}
+
 bool FileManager::hasHandler(const boost::filesystem::path& path) const {
-  std::lock_guard<std::mutex> this_lock(m_mutex);
-  auto                        canonical = weakly_canonical(path);
-  auto                        iter      = m_handlers.find(canonical);
-  return iter != m_handlers.end();
+  std::string key       = path.is_absolute() ? path.native() : boost::filesystem::absolute(path).native();
+  auto        canonical = lookupAlias(key);
+  if (canonical.empty())
+    canonical = weakly_canonical(boost::filesystem::path(key)).native();
+  if (lookupHandler(canonical))
+    return true;
+
+  Inode       inode;
+  std::string linked;
+  return statInode(canonical, inode) && lookupInode(inode, linked) != nullptr;
 }
 
 }  // end of namespace SourceXtractor
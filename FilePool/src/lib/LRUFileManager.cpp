@@ -18,71 +18,257 @@
 
 #include "FilePool/LRUFileManager.h"
 #include "ElementsKernel/Exception.h"
+#include <algorithm>
+#include <limits>
 #include <sys/resource.h>
 
 namespace SourceXtractor {
 
-LRUFileManager::LRUFileManager(unsigned limit) : m_limit(limit) {
+LRUFileManager::LRUFileManager(unsigned limit, unsigned watermark)
+    : LRUFileManager(limit, watermark, std::numeric_limits<std::size_t>::max()) {}
+
+LRUFileManager::LRUFileManager(unsigned limit, unsigned watermark, std::size_t budget)
+    : m_limit(limit)
+    , m_watermark(watermark)
+    , m_used(0)
+    , m_cost(0)
+    , m_budget(budget)
+    , m_sorted_ids(1)
+    , m_reaper_stop(false) {
   if (m_limit == 0) {
     struct rlimit rlim;
     getrlimit(RLIMIT_NOFILE, &rlim);
     assert(rlim.rlim_cur > 3);
     m_limit = rlim.rlim_cur - 3;  // Account for stdout, stderr and stdin
   }
+  if (m_watermark >= m_limit) {
+    throw Elements::Exception() << "The watermark must be lower than the limit of open files";
+  }
+  if (m_watermark > 0) {
+    m_reaper = std::thread(&LRUFileManager::reaperLoop, this);
+  }
 }
 
 LRUFileManager::~LRUFileManager() {
+  if (m_reaper.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_reaper_stop = true;
+    }
+    m_reaper_cv.notify_one();
+    m_reaper.join();
+  }
   closeAll();
 }
 
-void LRUFileManager::notifyIntentToOpen(bool /*write*/) {
-  std::unique_lock<std::mutex> lock(m_mutex);
+constexpr unsigned LRUFileManager::kNoGroup;
+constexpr unsigned LRUFileManager::kCostWindow;
+
+auto LRUFileManager::sortedIds(FileId id) -> FileList& {
+  // Groups can be defined at any time, so their lists are created on first use
+  if (id->m_group >= m_sorted_ids.size()) {
+    m_sorted_ids.resize(m_groups.size());
+  }
+  return m_sorted_ids[id->m_group];
+}
+
+bool LRUFileManager::hasRoom(unsigned count, unsigned group) const {
+  auto& quota = m_groups[group];
+  return m_used + count <= m_limit && (quota.m_max == 0 || quota.m_used + count <= quota.m_max);
+}
+
+auto LRUFileManager::pickVictim(unsigned group, unsigned count) -> FileId {
+  FileId own = group != kNoGroup && group < m_sorted_ids.size() ? m_sorted_ids[group].m_head : nullptr;
+
+  // What is left once the minimums are granted is split evenly between the groups with files open,
+  // and the one opening
+  unsigned reserved = 0, active = 0;
+  for (unsigned i = 0; i < m_groups.size(); ++i) {
+    reserved += m_groups[i].m_min;
+    if (m_groups[i].m_used > 0 || i == group)
+      ++active;
+  }
+  unsigned spare = reserved < m_limit ? m_limit - reserved : 0;
+  auto     share = [this, spare, active](unsigned i) {
+    unsigned fair = m_groups[i].m_min + spare / std::max(active, 1u);
+    return m_groups[i].m_max > 0 ? std::min(fair, m_groups[i].m_max) : fair;
+  };
+
+  if (group != kNoGroup) {
+    // A group at its maximum can only make room closing its own files
+    auto& quota = m_groups[group];
+    if (quota.m_max > 0 && quota.m_used + count > quota.m_max) {
+      return own;
+    }
+    // Same if it would go over its share, as long as it has files to close
+    if (own && quota.m_used + count > share(group)) {
+      return own;
+    }
+  }
+
+  // The least recently used of the groups above their share, or else of those above their minimum
+  FileId victim = nullptr, above_min = nullptr;
+  for (unsigned i = 0; i < m_sorted_ids.size(); ++i) {
+    FileId head = m_sorted_ids[i].m_head;
+    if (!head || m_groups[i].m_used <= m_groups[i].m_min)
+      continue;
+    FileId& oldest = m_groups[i].m_used > share(i) ? victim : above_min;
+    if (!oldest || head->m_last_used < oldest->m_last_used) {
+      oldest = head;
+    }
+  }
+  if (!victim) {
+    victim = above_min;
+  }
+
+  // Otherwise, the group can still close its own files
+  return victim ? victim : own;
+}
+
+auto LRUFileManager::costliestOf(FileId id) -> FileId {
+  // The list is sorted by use, so these are the least recently used of the same group
+  FileId costliest = id;
+  for (unsigned i = 1; i < kCostWindow && (id = id->m_next); ++i) {
+    if (id->m_cost > costliest->m_cost) {
+      costliest = id;
+    }
+  }
+  return costliest;
+}
 
-  while (m_files.size() >= m_limit) {
-    bool closed = false;
-    for (auto& id : m_sorted_ids) {
-      auto& meta       = m_files[id];
-      auto  close_call = meta->m_request_close;
-      lock.unlock();
-      closed = close_call();
-      lock.lock();
-      // If the file was closed, the iterator on m_sorted_ids has been invalidated!
-      if (closed)
-        break;
+bool LRUFileManager::closeOldest(std::unique_lock<std::mutex>& lock, unsigned group, unsigned count, bool by_cost) {
+  while (FileId id = pickVictim(group, count)) {
+    if (by_cost) {
+      id = costliestOf(id);
     }
-    if (!closed) {
-      throw Elements::Exception() << "Limit reached and failed to close any existing file descriptor";
+    if (evict(lock, sortedIds(id), id))
+      return true;
+  }
+  return false;
+}
+
+void LRUFileManager::reaperLoop() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (!m_reaper_stop) {
+    // If everything is in use, there is nothing to be done until some file is released
+    if (m_files.size() <= m_watermark || !closeOldest(lock, kNoGroup, 0)) {
+      m_reaper_cv.wait(lock);
     }
   }
 }
 
+void LRUFileManager::notifyIntentToOpen(bool write, unsigned count) {
+  notifyGroupIntentToOpen(write, count, 0);
+}
+
+void LRUFileManager::notifyGroupIntentToOpen(bool /*write*/, unsigned count, unsigned group) {
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  if (count > m_limit) {
+    throw Elements::Exception() << "Can not open " << count << " files at once, the limit is " << m_limit;
+  }
+  if (m_groups[group].m_max > 0 && count > m_groups[group].m_max) {
+    throw Elements::Exception() << "Can not open " << count << " files of the group at once, its maximum is "
+                                << m_groups[group].m_max;
+  }
+
+  auto take = [this, count, group]() {
+    if (!hasRoom(count, group))
+      return false;
+    m_used += count;
+    m_groups[group].m_used += count;
+    return true;
+  };
+  makeRoom(lock, take, [this, &lock, count, group]() { return closeOldest(lock, group, count); });
+}
+
+void LRUFileManager::notifyIntentToCharge(std::size_t cost, unsigned group) {
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  if (cost > m_budget) {
+    throw Elements::Exception() << "Can not open a file that costs " << cost << ", the budget is " << m_budget;
+  }
+
+  auto take = [this, cost]() {
+    if (m_cost + cost > m_budget)
+      return false;
+    m_cost += cost;
+    return true;
+  };
+  makeRoom(lock, take, [this, &lock, group]() { return closeOldest(lock, group, 0, true); });
+}
+
+void LRUFileManager::notifyChargeReturned(std::size_t cost) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_cost -= cost;
+}
+
 void LRUFileManager::notifyOpenedFile(FileManager::FileId id) {
   std::lock_guard<std::mutex> lock(m_mutex);
-  m_sorted_ids.emplace_back(id);
-  m_current_pos[id] = m_sorted_ids.end();
-  --m_current_pos[id];
+  sortedIds(id).pushBack(id);
+  if (m_files.size() > m_watermark && m_reaper.joinable()) {
+    m_reaper_cv.notify_one();
+  }
 }
 
 void LRUFileManager::notifyClosedFile(FileManager::FileId id) {
   std::lock_guard<std::mutex> lock(m_mutex);
-  auto                        iter = m_current_pos[id];
-  m_current_pos.erase(id);
-  m_sorted_ids.erase(iter);
+  if (!id->m_in_use) {
+    sortedIds(id).unlink(id);
+  }
+  m_cost -= id->m_cost;
+  --m_used;
+  --m_groups[id->m_group].m_used;
+}
+
+void LRUFileManager::notifyOpenFailed(bool write) {
+  notifyGroupOpenFailed(write, 0);
+}
+
+void LRUFileManager::notifyGroupOpenFailed(bool /*write*/, unsigned group) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  --m_used;
+  --m_groups[group].m_used;
 }
 
 void LRUFileManager::notifyUsed(FileManager::FileId id) {
-  // Update count
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  // The timestamp is read by pickVictim, so update it with the lock held
   id->m_last_used = Clock::now();
   ++id->m_used_count;
 
   // Bring it to the back, since it is the last used
+  if (!id->m_in_use) {
+    sortedIds(id).touch(id);
+  }
+}
+
+void LRUFileManager::notifyAcquired(FileManager::FileId id) {
   std::lock_guard<std::mutex> lock(m_mutex);
-  auto                        iter = m_current_pos[id];
-  auto                        ptr  = std::move(*iter);
-  m_sorted_ids.erase(iter);
-  m_sorted_ids.emplace_back(std::move(ptr));
-  m_current_pos[id] = m_sorted_ids.end();
-  --m_current_pos[id];
+
+  id->m_last_used = Clock::now();
+  ++id->m_used_count;
+
+  // Take it out of the list until released, so it is not asked to close meanwhile
+  if (!id->m_in_use) {
+    sortedIds(id).unlink(id);
+    id->m_in_use = true;
+  }
+}
+
+void LRUFileManager::notifyReleased(FileManager::FileId id) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (id->m_in_use) {
+      id->m_in_use = false;
+      sortedIds(id).pushBack(id);
+    }
+    if (m_files.size() > m_watermark && m_reaper.joinable()) {
+      m_reaper_cv.notify_one();
+    }
+  }
+  FileManager::notifyReleased(id);
 }
 
 unsigned int LRUFileManager::getLimit() const {
@@ -90,11 +276,22 @@ unsigned int LRUFileManager::getLimit() const {
 }
 
 unsigned int LRUFileManager::getUsed() const {
-  return m_sorted_ids.size();
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_files.size();
 }
 
 unsigned int LRUFileManager::getAvailable() const {
-  return m_limit - m_sorted_ids.size();
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_limit - m_used;
+}
+
+std::size_t LRUFileManager::getBudget() const {
+  return m_budget;
+}
+
+std::size_t LRUFileManager::getCost() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_cost;
 }
 
 }  // end of namespace SourceXtractor
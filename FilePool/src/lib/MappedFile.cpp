@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/MappedFile.h"
+#include "ElementsKernel/Exception.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace SourceXtractor {
+
+constexpr bool OpenCloseTrait<MappedFile>::kShareable;
+
+MappedFile OpenCloseTrait<MappedFile>::open(const boost::filesystem::path& path, bool write) {
+  int fd = ::open(path.native().c_str(), write ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    throw Elements::Exception() << "Failed to open " << path << ": " << strerror(errno);
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int err = errno;
+    ::close(fd);
+    throw Elements::Exception() << "Failed to stat " << path << ": " << strerror(err);
+  }
+
+  MappedFile mapped{nullptr, static_cast<std::size_t>(st.st_size), write};
+
+  // mmap does not accept a length of 0
+  if (mapped.m_size > 0) {
+    int   prot    = write ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* address = mmap(nullptr, mapped.m_size, prot, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+      int err = errno;
+      ::close(fd);
+      throw Elements::Exception() << "Failed to map " << path << ": " << strerror(err);
+    }
+    mapped.m_data = static_cast<char*>(address);
+  }
+
+  // The mapping keeps its own reference to the file
+  ::close(fd);
+  return mapped;
+}
+
+MappedFile OpenCloseTrait<MappedFile>::openUpdate(const boost::filesystem::path& path) {
+  return open(path, true);
+}
+
+void OpenCloseTrait<MappedFile>::close(MappedFile& mapped) {
+  if (mapped.m_data) {
+    munmap(mapped.m_data, mapped.m_size);
+    mapped.m_data = nullptr;
+  }
+}
+
+void OpenCloseTrait<MappedFile>::advise(MappedFile& mapped, int advice, off_t offset, off_t length) {
+  if (!mapped.m_data || offset < 0 || static_cast<std::size_t>(offset) >= mapped.m_size)
+    return;
+
+  int madvice;
+  switch (advice) {
+  case POSIX_FADV_SEQUENTIAL:
+    madvice = MADV_SEQUENTIAL;
+    break;
+  case POSIX_FADV_RANDOM:
+    madvice = MADV_RANDOM;
+    break;
+  case POSIX_FADV_WILLNEED:
+    madvice = MADV_WILLNEED;
+    break;
+  case POSIX_FADV_DONTNEED:
+    // The mapping is shared, so this only drops the pages from this process, the content is kept
+    madvice = MADV_DONTNEED;
+    break;
+  default:
+    madvice = MADV_NORMAL;
+  }
+
+  // madvise requires the start to be aligned to a page
+  static const std::size_t page_size = sysconf(_SC_PAGESIZE);
+  std::size_t              start     = offset - offset % page_size;
+  std::size_t              end       = mapped.m_size;
+  if (length > 0) {
+    end = std::min(end, static_cast<std::size_t>(offset + length));
+  }
+  // Only a hint, so errors are ignored
+  madvise(mapped.m_data + start, end - start, madvice);
+}
+
+std::size_t OpenCloseTrait<MappedFile>::cost(const MappedFile& mapped) {
+  return mapped.m_size;
+}
+
+std::size_t OpenCloseTrait<MappedFile>::expectedCost(const boost::filesystem::path& path, bool /*write*/) {
+  // If it can not be stated, open will fail anyway
+  struct stat st;
+  if (::stat(path.native().c_str(), &st) < 0) {
+    return 0;
+  }
+  return static_cast<std::size_t>(st.st_size);
+}
+
+}  // end of namespace SourceXtractor
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/ShardedLRUFileManager.h"
+#include "AlexandriaKernel/memory_tools.h"
+#include "ElementsKernel/Exception.h"
+#include <sys/resource.h>
+#include <thread>
+
+namespace SourceXtractor {
+
+ShardedLRUFileManager::ShardedLRUFileManager(unsigned limit, unsigned nshards) : m_limit(limit), m_used(0) {
+  if (m_limit == 0) {
+    struct rlimit rlim;
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    assert(rlim.rlim_cur > 3);
+    m_limit = rlim.rlim_cur - 3;  // Account for stdout, stderr and stdin
+  }
+  if (nshards == 0) {
+    nshards = std::max(1u, std::thread::hardware_concurrency());
+  }
+  for (unsigned i = 0; i < nshards; ++i) {
+    m_shards.emplace_back(Euclid::make_unique<Shard>());
+  }
+}
+
+ShardedLRUFileManager::~ShardedLRUFileManager() {
+  closeAll();
+}
+
+auto ShardedLRUFileManager::getShard(FileId id) -> Shard& {
+  // Metadata is heap allocated, so the lower bits carry no information
+  auto hash = (reinterpret_cast<uintptr_t>(id) >> 4) * 0x9E3779B97F4A7C15ull;
+  return *m_shards[(hash >> 32) % m_shards.size()];
+}
+
+void ShardedLRUFileManager::notifyIntentToOpen(bool /*write*/, unsigned count) {
+  if (count > m_limit) {
+    throw Elements::Exception() << "Can not open " << count << " files at once, the limit is " << m_limit;
+  }
+
+  // Reserve the slots before opening, so concurrent openings can not go over the limit
+  auto take = [this, count]() {
+    unsigned used = m_used.load();
+    while (used + count <= m_limit) {
+      if (m_used.compare_exchange_weak(used, used + count))
+        return true;
+    }
+    return false;
+  };
+
+  // Without anyone waiting, there is no need to lock m_mutex
+  if (!hasWaiters()) {
+    do {
+      if (take())
+        return;
+    } while (closeOldest());
+  }
+
+  // The shards are not protected by m_mutex, so release it while trying to close
+  std::unique_lock<std::mutex> lock(m_mutex);
+  auto                         close_one = [this, &lock]() {
+    lock.unlock();
+    bool closed = closeOldest();
+    lock.lock();
+    return closed;
+  };
+  makeRoom(lock, take, close_one);
+}
+
+bool ShardedLRUFileManager::closeOldest() {
+  while (true) {
+    Shard*    oldest_shard = nullptr;
+    Timestamp oldest_ts    = Timestamp::max();
+    for (auto& shard : m_shards) {
+      std::lock_guard<std::mutex> lock(shard->m_mutex);
+      auto                        head = shard->m_sorted_ids.m_head;
+      if (head && head->m_last_used < oldest_ts) {
+        oldest_ts    = head->m_last_used;
+        oldest_shard = shard.get();
+      }
+    }
+    if (!oldest_shard)
+      return false;
+
+    std::unique_lock<std::mutex> lock(oldest_shard->m_mutex);
+    FileId                       id = oldest_shard->m_sorted_ids.m_head;
+    // Someone else may have closed or acquired it meanwhile
+    if (id && evict(lock, oldest_shard->m_sorted_ids, id))
+      return true;
+  }
+}
+
+void ShardedLRUFileManager::notifyOpenedFile(FileId id) {
+  auto&                       shard = getShard(id);
+  std::lock_guard<std::mutex> lock(shard.m_mutex);
+  shard.m_sorted_ids.pushBack(id);
+}
+
+void ShardedLRUFileManager::notifyClosedFile(FileId id) {
+  {
+    auto&                       shard = getShard(id);
+    std::lock_guard<std::mutex> lock(shard.m_mutex);
+    if (!id->m_in_use) {
+      shard.m_sorted_ids.unlink(id);
+    }
+  }
+  --m_used;
+}
+
+void ShardedLRUFileManager::notifyOpenFailed(bool /*write*/) {
+  --m_used;
+}
+
+void ShardedLRUFileManager::notifyUsed(FileId id) {
+  auto&                       shard = getShard(id);
+  std::lock_guard<std::mutex> lock(shard.m_mutex);
+
+  // The timestamp is read by closeOldest, so update it with the lock held
+  id->m_last_used = Clock::now();
+  ++id->m_used_count;
+
+  // Bring it to the back, since it is the last used
+  if (!id->m_in_use) {
+    shard.m_sorted_ids.touch(id);
+  }
+}
+
+void ShardedLRUFileManager::notifyAcquired(FileId id) {
+  auto&                       shard = getShard(id);
+  std::lock_guard<std::mutex> lock(shard.m_mutex);
+
+  id->m_last_used = Clock::now();
+  ++id->m_used_count;
+
+  // Take it out of the list until released, so it is not asked to close meanwhile
+  if (!id->m_in_use) {
+    shard.m_sorted_ids.unlink(id);
+    id->m_in_use = true;
+  }
+}
+
+void ShardedLRUFileManager::notifyReleased(FileId id) {
+  {
+    auto&                       shard = getShard(id);
+    std::lock_guard<std::mutex> lock(shard.m_mutex);
+    if (id->m_in_use) {
+      // The shards are compared by the timestamp of their head, so it must follow the list order
+      id->m_last_used = Clock::now();
+      id->m_in_use    = false;
+      shard.m_sorted_ids.pushBack(id);
+    }
+  }
+  FileManager::notifyReleased(id);
+}
+
+unsigned int ShardedLRUFileManager::getLimit() const {
+  return m_limit;
+}
+
+unsigned int ShardedLRUFileManager::getUsed() const {
+  return m_used;
+}
+
+unsigned int ShardedLRUFileManager::getAvailable() const {
+  return m_limit - m_used;
+}
+
+unsigned int ShardedLRUFileManager::getShardCount() const {
+  return m_shards.size();
+}
+
+}  // end of namespace SourceXtractor
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/TwoQueueFileManager.h"
+#include "ElementsKernel/Exception.h"
+#include <sys/resource.h>
+
+namespace SourceXtractor {
+
+TwoQueueFileManager::TwoQueueFileManager(unsigned limit, double in_ratio, double ghost_ratio)
+    : m_limit(limit), m_used(0) {
+  if (m_limit == 0) {
+    struct rlimit rlim;
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    assert(rlim.rlim_cur > 3);
+    m_limit = rlim.rlim_cur - 3;  // Account for stdout, stderr and stdin
+  }
+  m_in_limit    = std::max(1u, static_cast<unsigned>(m_limit * in_ratio));
+  m_ghost_limit = static_cast<unsigned>(m_limit * ghost_ratio);
+}
+
+TwoQueueFileManager::~TwoQueueFileManager() {
+  closeAll();
+}
+
+bool TwoQueueFileManager::closeOldest(std::unique_lock<std::mutex>& lock) {
+  // Prefer the FIFO queue while it is above its share, and fallback to the other one if
+  // all its files are in use. As in the LRU, the ones that refuse to close are moved to the back
+  FileList* queues[] = {&m_in, &m_frequent};
+  if (m_in.m_size <= m_in_limit && m_frequent.m_size > 0) {
+    std::swap(queues[0], queues[1]);
+  }
+
+  for (auto queue : queues) {
+    for (unsigned attempts = queue->m_size; attempts > 0 && queue->m_head; --attempts) {
+      FileId id = queue->m_head;
+      queue->touch(id);
+      // Files evicted from the FIFO queue are remembered, but their metadata is gone once closed
+      boost::filesystem::path path;
+      if (queue == &m_in) {
+        path = id->m_path;
+      }
+      if (requestClose(lock, id)) {
+        if (!path.empty())
+          remember(path);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void TwoQueueFileManager::notifyIntentToOpen(bool /*write*/, unsigned count) {
+  std::unique_lock<std::mutex> lock(m_mutex);
+
+  if (count > m_limit) {
+    throw Elements::Exception() << "Can not open " << count << " files at once, the limit is " << m_limit;
+  }
+
+  auto take = [this, count]() {
+    if (m_used + count > m_limit)
+      return false;
+    m_used += count;
+    return true;
+  };
+  makeRoom(lock, take, [this, &lock]() { return closeOldest(lock); });
+}
+
+void TwoQueueFileManager::notifyOpenedFile(FileId id) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  // Evicted not long ago, so it is not a one-off
+  auto ghost_i = m_ghost_pos.find(id->m_path);
+  if (ghost_i != m_ghost_pos.end()) {
+    m_ghost.erase(ghost_i->second);
+    m_ghost_pos.erase(ghost_i);
+    id->m_queue = kFrequent;
+    m_frequent.pushBack(id);
+  } else {
+    id->m_queue = kIn;
+    m_in.pushBack(id);
+  }
+}
+
+void TwoQueueFileManager::notifyClosedFile(FileId id) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (id->m_queue == kFrequent) {
+    m_frequent.unlink(id);
+  } else {
+    m_in.unlink(id);
+  }
+  --m_used;
+}
+
+void TwoQueueFileManager::notifyOpenFailed(bool /*write*/) {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  --m_used;
+}
+
+void TwoQueueFileManager::notifyUsed(FileId id) {
+  FileManager::notifyUsed(id);
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (id->m_queue == kFrequent) {
+    m_frequent.touch(id);
+  }
+  // The first use comes right after opening, the second one is a re-use
+  else if (id->m_used_count > 1) {
+    m_in.unlink(id);
+    id->m_queue = kFrequent;
+    m_frequent.pushBack(id);
+  }
+}
+
+void TwoQueueFileManager::remember(const boost::filesystem::path& path) {
+  if (m_ghost_limit == 0 || m_ghost_pos.count(path))
+    return;
+  if (m_ghost.size() >= m_ghost_limit) {
+    m_ghost_pos.erase(m_ghost.front());
+    m_ghost.pop_front();
+  }
+  m_ghost.emplace_back(path);
+  m_ghost_pos[path] = std::prev(m_ghost.end());
+}
+
+unsigned int TwoQueueFileManager::getLimit() const {
+  return m_limit;
+}
+
+unsigned int TwoQueueFileManager::getUsed() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_in.m_size + m_frequent.m_size;
+}
+
+unsigned int TwoQueueFileManager::getAvailable() const {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_limit - m_used;
+}
+
+}  // end of namespace SourceXtractor
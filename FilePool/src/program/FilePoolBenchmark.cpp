@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "ElementsKernel/ProgramHeaders.h"
+#include "ElementsKernel/Temporary.h"
+#include "FilePool/BudgetFileManager.h"
+#include "FilePool/ClockFileManager.h"
+#include "FilePool/FileHandler.h"
+#include "FilePool/LRUFileManager.h"
+#include "FilePool/ShardedLRUFileManager.h"
+#include "FilePool/TwoQueueFileManager.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <thread>
+#include <unistd.h>
+
+using boost::program_options::options_description;
+using boost::program_options::value;
+using boost::program_options::variable_value;
+
+namespace SourceXtractor {
+
+/**
+ * Counts how many times the pool opens and closes a descriptor, regardless of its type
+ */
+struct BenchmarkCounters {
+  static std::atomic<uint64_t> s_opened;
+  static std::atomic<uint64_t> s_closed;
+
+  static void reset() {
+    s_opened = 0;
+    s_closed = 0;
+  }
+};
+
+std::atomic<uint64_t> BenchmarkCounters::s_opened{0};
+std::atomic<uint64_t> BenchmarkCounters::s_closed{0};
+
+/**
+ * An opaque non copyable used as a file handler (intended to mimic cfitsio handlers)
+ */
+struct CfitsioLike {
+  int   fd;
+  char* buffer;
+};
+
+static int openRaw(const boost::filesystem::path& path, bool write) {
+  int fd = ::open(path.native().c_str(), write ? O_RDWR : O_RDONLY);
+  if (fd < 0) {
+    throw Elements::Exception() << "Failed to open " << path << ": " << strerror(errno);
+  }
+  ++BenchmarkCounters::s_opened;
+  return fd;
+}
+
+static void closeRaw(int fd) {
+  ::close(fd);
+  ++BenchmarkCounters::s_closed;
+}
+
+template <>
+struct OpenCloseTrait<int> {
+  static int open(const boost::filesystem::path& path, bool write) {
+    return openRaw(path, write);
+  }
+
+  static int openUpdate(const boost::filesystem::path& path) {
+    return openRaw(path, true);
+  }
+
+  static void close(int fd) {
+    closeRaw(fd);
+  }
+};
+
+template <>
+struct OpenCloseTrait<CfitsioLike*> {
+  static CfitsioLike* open(const boost::filesystem::path& path, bool write) {
+    return new CfitsioLike{openRaw(path, write), new char[1024]};
+  }
+
+  static CfitsioLike* openUpdate(const boost::filesystem::path& path) {
+    return new CfitsioLike{openRaw(path, true), new char[1024]};
+  }
+
+  static void close(CfitsioLike* ptr) {
+    closeRaw(ptr->fd);
+    delete[] ptr->buffer;
+    delete ptr;
+  }
+};
+
+/**
+ * A descriptor only used with positional I/O, so it can be shared between readers
+ */
+struct PositionalFd {
+  int fd;
+};
+
+template <>
+struct OpenCloseTrait<PositionalFd> {
+  static constexpr bool kShareable = true;
+
+  static PositionalFd open(const boost::filesystem::path& path, bool write) {
+    return PositionalFd{openRaw(path, write)};
+  }
+
+  static PositionalFd openUpdate(const boost::filesystem::path& path) {
+    return PositionalFd{openRaw(path, true)};
+  }
+
+  static void close(PositionalFd& pfd) {
+    closeRaw(pfd.fd);
+  }
+};
+
+template <>
+struct OpenCloseTrait<std::fstream> {
+  static std::fstream open(const boost::filesystem::path& path, bool write) {
+    auto mode = std::ios_base::in;
+    if (write)
+      mode |= std::ios_base::out;
+    std::fstream stream(path.native(), mode);
+    if (!stream.is_open()) {
+      throw Elements::Exception() << "Failed to open " << path;
+    }
+    ++BenchmarkCounters::s_opened;
+    return stream;
+  }
+
+  static void close(std::fstream& stream) {
+    stream.close();
+    ++BenchmarkCounters::s_closed;
+  }
+};
+
+}  // namespace SourceXtractor
+
+using namespace SourceXtractor;
+
+/**
+ * One point of the parameter space
+ */
+struct BenchmarkConfig {
+  std::string manager;
+  std::string type;
+  unsigned    nthreads;
+  unsigned    nfiles;
+  double      limit_ratio;
+  double      write_ratio;
+  unsigned    iterations;
+  bool        wait;
+  bool        keep;
+};
+
+/**
+ * Aggregated measurements for one BenchmarkConfig
+ */
+struct BenchmarkResult {
+  unsigned              limit;
+  uint64_t              ops;
+  uint64_t              failures;
+  double                seconds;
+  std::vector<uint64_t> latencies;
+  uint64_t              opened;
+  uint64_t              closed;
+};
+
+static std::shared_ptr<FileManager> createManager(const std::string& name, unsigned limit) {
+  if (name == "lru") {
+    return std::make_shared<LRUFileManager>(limit);
+  } else if (name == "lru-reaper") {
+    return std::make_shared<LRUFileManager>(limit, limit * 9 / 10);
+  } else if (name == "sharded") {
+    return std::make_shared<ShardedLRUFileManager>(limit);
+  } else if (name == "clock") {
+    return std::make_shared<ClockFileManager>(limit);
+  } else if (name == "2q") {
+    return std::make_shared<TwoQueueFileManager>(limit);
+  } else if (name == "budget") {
+    // The benchmarked descriptors declare no cost, so this measures the overhead over lru
+    return std::make_shared<BudgetFileManager>(limit, std::numeric_limits<std::size_t>::max());
+  }
+  throw Elements::Exception() << "Unknown file manager " << name;
+}
+
+static uint64_t percentile(std::vector<uint64_t>& sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  size_t idx = static_cast<size_t>(std::ceil(p * sorted.size()));
+  if (idx > 0)
+    --idx;
+  return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+/**
+ * Each thread picks a random file and acquires an accessor for it, with the given read/write mix.
+ * Only the time spent inside getAccessor is recorded as latency, but the throughput
+ * includes the release of the accessor.
+ */
+template <typename TFD>
+static BenchmarkResult runBenchmark(const BenchmarkConfig& config, const std::vector<boost::filesystem::path>& paths) {
+  using SteadyClock = std::chrono::steady_clock;
+
+  BenchmarkResult result;
+  result.limit = std::max(1u, static_cast<unsigned>(std::lround(config.limit_ratio * config.nfiles)));
+
+  auto                                      manager = createManager(config.manager, result.limit);
+  manager->setWaitForRelease(config.wait);
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (unsigned i = 0; i < config.nfiles; ++i) {
+    handlers.emplace_back(manager->getFileHandler(paths[i]));
+    handlers.back()->setKeepOnModeSwitch(config.keep);
+  }
+
+  std::vector<std::vector<uint64_t>> latencies(config.nthreads);
+  std::atomic<uint64_t>              failures{0};
+  std::atomic<bool>                  start{false};
+  std::vector<std::thread>           threads;
+
+  BenchmarkCounters::reset();
+
+  for (unsigned t = 0; t < config.nthreads; ++t) {
+    threads.emplace_back([&, t]() {
+      std::mt19937                            rng(t);
+      std::uniform_int_distribution<unsigned> file_dist(0, config.nfiles - 1);
+      std::bernoulli_distribution             write_dist(config.write_ratio);
+      auto&                                   thread_latencies = latencies[t];
+      thread_latencies.reserve(config.iterations);
+
+      while (!start) {
+        std::this_thread::yield();
+      }
+
+      for (unsigned i = 0; i < config.iterations; ++i) {
+        auto& handler = handlers[file_dist(rng)];
+        auto  mode    = write_dist(rng) ? FileHandler::kWrite : FileHandler::kRead;
+        try {
+          auto begin    = SteadyClock::now();
+          auto accessor = handler->getAccessor<TFD>(mode);
+          auto end      = SteadyClock::now();
+          thread_latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+        } catch (const Elements::Exception&) {
+          // All descriptors checked out by other threads
+          ++failures;
+        }
+      }
+    });
+  }
+
+  auto begin = SteadyClock::now();
+  start      = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto end = SteadyClock::now();
+
+  result.seconds  = std::chrono::duration<double>(end - begin).count();
+  result.failures = failures;
+  result.opened   = BenchmarkCounters::s_opened;
+  result.closed   = BenchmarkCounters::s_closed;
+  for (auto& thread_latencies : latencies) {
+    result.latencies.insert(result.latencies.end(), thread_latencies.begin(), thread_latencies.end());
+  }
+  result.ops = result.latencies.size();
+  std::sort(result.latencies.begin(), result.latencies.end());
+  return result;
+}
+
+static void printHeader(std::ostream& out) {
+  out << "manager,type,threads,files,limit,write_ratio,ops,failures,seconds,ops_per_s,"
+         "p50_ns,p99_ns,p999_ns,max_ns,opened,closed,eviction_rate"
+      << std::endl;
+}
+
+static void printResult(std::ostream& out, const BenchmarkConfig& config, BenchmarkResult& result) {
+  out << config.manager << ',' << config.type << ',' << config.nthreads << ',' << config.nfiles << ',' << result.limit << ','
+      << config.write_ratio << ',' << result.ops << ',' << result.failures << ',' << result.seconds << ','
+      << result.ops / result.seconds << ',' << percentile(result.latencies, 0.5) << ',' << percentile(result.latencies, 0.99)
+      << ',' << percentile(result.latencies, 0.999) << ',' << (result.latencies.empty() ? 0 : result.latencies.back()) << ','
+      << result.opened << ',' << result.closed << ',' << (result.ops ? static_cast<double>(result.closed) / result.ops : 0.)
+      << std::endl;
+}
+
+class FilePoolBenchmark : public Elements::Program {
+public:
+  options_description defineSpecificProgramOptions() override {
+    options_description options("FilePool benchmark options");
+    auto                add = options.add_options();
+    add("manager", value<std::vector<std::string>>()->multitoken()->default_value({"lru"}, "lru"),
+        "File managers: lru, lru-reaper, sharded, clock, 2q and/or budget");
+    add("type", value<std::vector<std::string>>()->multitoken()->default_value({"int"}, "int"),
+        "Descriptor types: int, cfitsio, fstream and/or pread (shared between readers)");
+    add("threads", value<std::vector<unsigned>>()->multitoken()->default_value({1, 2, 4, 8}, "1 2 4 8"),
+        "Number of concurrent threads");
+    add("files", value<std::vector<unsigned>>()->multitoken()->default_value({10, 100}, "10 100"), "Number of files");
+    add("limit-ratio", value<std::vector<double>>()->multitoken()->default_value({0.5, 2.}, "0.5 2"),
+        "File manager limit as a fraction of the number of files");
+    add("write-ratio", value<std::vector<double>>()->multitoken()->default_value({0., 0.1}, "0 0.1"),
+        "Fraction of the accesses done in write mode");
+    add("iterations", value<unsigned>()->default_value(10000), "Accessor acquisitions per thread");
+    add("wait", boost::program_options::bool_switch(), "Wait for a descriptor to be released instead of failing");
+    add("keep-on-mode-switch", boost::program_options::bool_switch(),
+        "Keep the descriptors opened in the previous mode when switching between read and write");
+    add("output", value<std::string>()->default_value("-"), "CSV output file, - for stdout");
+    return options;
+  }
+
+  Elements::ExitCode mainMethod(std::map<std::string, variable_value>& args) override {
+    auto managers     = args.at("manager").as<std::vector<std::string>>();
+    auto types        = args.at("type").as<std::vector<std::string>>();
+    auto threads      = args.at("threads").as<std::vector<unsigned>>();
+    auto files        = args.at("files").as<std::vector<unsigned>>();
+    auto limit_ratios = args.at("limit-ratio").as<std::vector<double>>();
+    auto write_ratios = args.at("write-ratio").as<std::vector<double>>();
+    auto iterations   = args.at("iterations").as<unsigned>();
+    auto wait         = args.at("wait").as<bool>();
+    auto keep         = args.at("keep-on-mode-switch").as<bool>();
+    auto output_path  = args.at("output").as<std::string>();
+
+    std::ofstream output_file;
+    if (output_path != "-") {
+      output_file.open(output_path);
+    }
+    std::ostream& out = output_file.is_open() ? output_file : std::cout;
+
+    // Create the largest working set once, smaller ones are a prefix
+    Elements::TempDir                    temp_dir;
+    std::vector<boost::filesystem::path> paths;
+    unsigned                             max_files = *std::max_element(files.begin(), files.end());
+    for (unsigned i = 0; i < max_files; ++i) {
+      paths.emplace_back(temp_dir.path() / ("file_" + std::to_string(i)));
+      std::ofstream stream(paths.back().native());
+      stream << "THIS IS FILE " << i;
+    }
+
+    printHeader(out);
+
+    for (auto& manager : managers) {
+      for (auto& type : types) {
+        for (auto nthreads : threads) {
+          for (auto nfiles : files) {
+            for (auto limit_ratio : limit_ratios) {
+              for (auto write_ratio : write_ratios) {
+                BenchmarkConfig config{manager,     type,       nthreads, nfiles, limit_ratio,
+                                       write_ratio, iterations, wait,     keep};
+                BenchmarkResult result;
+                if (type == "int") {
+                  result = runBenchmark<int>(config, paths);
+                } else if (type == "cfitsio") {
+                  result = runBenchmark<CfitsioLike*>(config, paths);
+                } else if (type == "fstream") {
+                  result = runBenchmark<std::fstream>(config, paths);
+                } else if (type == "pread") {
+                  result = runBenchmark<PositionalFd>(config, paths);
+                } else {
+                  throw Elements::Exception() << "Unknown descriptor type " << type;
+                }
+                printResult(out, config, result);
+              }
+            }
+          }
+        }
+      }
+    }
+
+    return Elements::ExitCode::OK;
+  }
+};
+
+MAIN_FOR(FilePoolBenchmark)
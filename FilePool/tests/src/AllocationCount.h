@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef POOLTESTS_ALLOCATIONCOUNT_H
+#define POOLTESTS_ALLOCATIONCOUNT_H
+
+#include <cstdlib>
+#include <new>
+
+/**
+ * Replaces the global operator new, counting the allocations done by each thread, so a test can check
+ * that a code path does not allocate.
+ * @warning
+ *  It must only be included by one source file of the test
+ */
+
+// Otherwise, the compiler may see malloc and free once inlined, and warn about them not matching new and delete
+#ifdef __GNUC__
+#define ALLOCATION_COUNT_NOINLINE __attribute__((noinline))
+#else
+#define ALLOCATION_COUNT_NOINLINE
+#endif
+
+static thread_local std::size_t s_allocation_count = 0;
+
+ALLOCATION_COUNT_NOINLINE void* operator new(std::size_t size) {
+  ++s_allocation_count;
+  void* ptr = std::malloc(size ? size : 1);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+ALLOCATION_COUNT_NOINLINE void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+ALLOCATION_COUNT_NOINLINE void operator delete(void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+/// @return Number of allocations done so far by the calling thread
+static std::size_t allocationCount() {
+  return s_allocation_count;
+}
+
+#endif  // POOLTESTS_ALLOCATIONCOUNT_H
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/AsyncIO.h"
+#include "ElementsKernel/Temporary.h"
+#include "FilePool/LRUFileManager.h"
+#include <atomic>
+#include <boost/test/unit_test.hpp>
+
+#include "TestFileTraits.h"
+
+using namespace SourceXtractor;
+
+struct AsyncIOFixture {
+  Elements::TempDir               dir;
+  std::string                     content;
+  std::shared_ptr<LRUFileManager> manager;
+
+  AsyncIOFixture() : content("0123456789abcdef0123456789ABCDEF"), manager(std::make_shared<LRUFileManager>(2)) {
+    std::ofstream stream((dir.path() / "a").native());
+    stream << content;
+  }
+};
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE(AsyncIOTest)
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestRead, AsyncIOFixture) {
+  auto handler = manager->getFileHandler(dir.path() / "a");
+
+  for (bool use_uring : {true, false}) {
+    AsyncIO async_io(2, 4, use_uring);
+    BOOST_TEST_MESSAGE("Using io_uring: " << async_io.usesUring());
+
+    // More requests than the queue depth
+    std::vector<std::string>      buffers(9, std::string(4, '\0'));
+    std::vector<AsyncIO::Request> requests;
+    for (std::size_t i = 0; i < buffers.size(); ++i) {
+      requests.push_back(AsyncIO::Request{handler, static_cast<off_t>(i * 4), 4, &buffers[i][0], nullptr});
+    }
+
+    auto futures = async_io.read<PositionalFd>(requests);
+    BOOST_REQUIRE_EQUAL(futures.size(), buffers.size());
+    for (std::size_t i = 0; i < 8; ++i) {
+      BOOST_CHECK_EQUAL(futures[i].get(), 4);
+      BOOST_CHECK_EQUAL(buffers[i], content.substr(i * 4, 4));
+    }
+    // Past the end of the file
+    BOOST_CHECK_EQUAL(futures[8].get(), 0);
+  }
+
+  // Only one descriptor was needed
+  BOOST_CHECK_EQUAL(manager->getUsed(), 1);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestWriteRead, AsyncIOFixture) {
+  auto handler_b = manager->getFileHandler(dir.path() / "b");
+  auto handler_c = manager->getFileHandler(dir.path() / "c");
+
+  for (bool use_uring : {true, false}) {
+    AsyncIO     async_io(1, 8, use_uring);
+    std::string text_b("Lorem ipsum"), text_c("dolor sit amet");
+
+    std::vector<AsyncIO::Request> writes{{handler_b, 0, text_b.size(), &text_b[0], nullptr},
+                                         {handler_c, 0, 5, &text_c[0], nullptr},
+                                         {handler_c, 5, text_c.size() - 5, &text_c[5], nullptr}};
+    for (auto& future : async_io.write<int>(writes)) {
+      BOOST_CHECK_GT(future.get(), 0);
+    }
+
+    std::string                   read_b(64, '\0'), read_c(64, '\0');
+    std::vector<AsyncIO::Request> reads{{handler_c, 0, read_c.size(), &read_c[0], nullptr},
+                                        {handler_b, 0, read_b.size(), &read_b[0], nullptr}};
+    auto                          futures = async_io.read<int>(reads);
+    read_c.resize(futures[0].get());
+    read_b.resize(futures[1].get());
+    BOOST_CHECK_EQUAL(read_b, text_b);
+    BOOST_CHECK_EQUAL(read_c, text_c);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestWriteAfterEviction, AsyncIOFixture) {
+  auto handler_a = manager->getFileHandler(dir.path() / "a");
+  auto handler_b = manager->getFileHandler(dir.path() / "b");
+  auto handler_c = manager->getFileHandler(dir.path() / "c");
+
+  for (bool use_uring : {true, false}) {
+    AsyncIO     async_io(1, 8, use_uring);
+    std::string first("Lorem ipsum"), second("dolor sit amet");
+
+    BOOST_CHECK_EQUAL(async_io.write<int>({{handler_b, 0, first.size(), &first[0], nullptr}})[0].get(), first.size());
+
+    // Both descriptors are needed elsewhere, so the one of b is closed
+    auto evictions = manager->getCounters().m_evictions;
+    {
+      auto accessor_a = handler_a->getAccessor<int>(FileHandler::kRead);
+      auto accessor_c = handler_c->getAccessor<int>(FileHandler::kWrite);
+      BOOST_CHECK_GT(manager->getCounters().m_evictions, evictions);
+    }
+
+    off_t offset = 32;
+    BOOST_CHECK_EQUAL(async_io.write<int>({{handler_b, offset, second.size(), &second[0], nullptr}})[0].get(),
+                      second.size());
+
+    std::string read_b(64, '\0');
+    read_b.resize(async_io.read<int>({{handler_b, 0, read_b.size(), &read_b[0], nullptr}})[0].get());
+    BOOST_REQUIRE_EQUAL(read_b.size(), offset + second.size());
+    BOOST_CHECK_EQUAL(read_b.substr(0, first.size()), first);
+    BOOST_CHECK_EQUAL(read_b.substr(offset), second);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestCallbacks, AsyncIOFixture) {
+  auto handler = manager->getFileHandler(dir.path() / "a");
+
+  AsyncIO            async_io(1);
+  std::string        buffer(content.size(), '\0');
+  std::promise<void> done;
+
+  // The accessor is already released when called, so the callback can use the file
+  auto callback = [&](std::size_t transferred, std::exception_ptr error) {
+    BOOST_CHECK(!error);
+    BOOST_CHECK_EQUAL(transferred, content.size());
+    BOOST_CHECK(handler->getAccessor<int>(FileHandler::kTryWrite));
+    done.set_value();
+  };
+
+  async_io.submit<PositionalFd>(AsyncIO::kRead, {{handler, 0, buffer.size(), &buffer[0], callback}});
+  BOOST_REQUIRE(done.get_future().wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+  BOOST_CHECK_EQUAL(buffer, content);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestMissing, AsyncIOFixture) {
+  auto handler = manager->getFileHandler(dir.path() / "a");
+  auto missing = manager->getFileHandler(dir.path() / "missing");
+
+  AsyncIO     async_io(1);
+  std::string buffer1(4, '\0'), buffer2(4, '\0');
+
+  auto futures = async_io.read<int>({{missing, 0, 4, &buffer1[0], nullptr}, {handler, 0, 4, &buffer2[0], nullptr}});
+
+  // The other files in the batch are not affected
+  BOOST_CHECK_THROW(futures[0].get(), Elements::Exception);
+  BOOST_CHECK_EQUAL(futures[1].get(), 4);
+  BOOST_CHECK_EQUAL(buffer2, content.substr(0, 4));
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestWaitForBatch, AsyncIOFixture) {
+  // Each batch needs all the descriptors, so workers holding part of a batch would block each other
+  manager->setWaitForRelease(true);
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto name : {"a", "b", "c", "d"}) {
+    std::ofstream((dir.path() / name).native()) << content;
+    handlers.emplace_back(manager->getFileHandler(dir.path() / name));
+  }
+
+  AsyncIO                               async_io(4);
+  std::vector<std::string>              buffers(200, std::string(4, '\0'));
+  std::vector<std::future<std::size_t>> futures;
+  for (std::size_t i = 0; i < buffers.size(); i += 2) {
+    auto first   = (i / 2) % 2 * 2;
+    auto batch   = async_io.read<int>({{handlers[first], 0, 4, &buffers[i][0], nullptr},
+                                       {handlers[first + 1], 4, 4, &buffers[i + 1][0], nullptr}});
+    std::move(batch.begin(), batch.end(), std::back_inserter(futures));
+  }
+
+  for (std::size_t i = 0; i < futures.size(); ++i) {
+    BOOST_REQUIRE(futures[i].wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+    BOOST_CHECK_EQUAL(futures[i].get(), 4);
+    BOOST_CHECK_EQUAL(buffers[i], content.substr(i % 2 * 4, 4));
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE_END()
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include "FilePool/BlockCache.h"
+#include "ElementsKernel/Temporary.h"
+#include "FilePool/LRUFileManager.h"
+#include <boost/test/unit_test.hpp>
+
+#include "TestFileTraits.h"
+
+using namespace SourceXtractor;
+
+struct BlockCacheFixture {
+  static constexpr std::size_t BLOCK_SIZE = 16;
+
+  Elements::TempPath              path;
+  std::string                     content;
+  std::shared_ptr<LRUFileManager> manager;
+  std::shared_ptr<BlockCache>     cache;
+  unsigned                        nreads;
+
+  BlockCacheFixture()
+      : content("0123456789abcdef0123456789ABCDEF0123456789")
+      , manager(std::make_shared<LRUFileManager>(2))
+      , cache(std::make_shared<BlockCache>(1024, BLOCK_SIZE, 2))
+      , nreads(0) {
+    std::ofstream stream(path.path().native());
+    stream << content;
+    manager->setBlockCache(cache);
+  }
+
+  std::string read(FileHandler& handler, std::uint64_t offset, std::size_t size) {
+    auto reader = [this](PositionalFd& fd, std::uint64_t block_offset, char* out, std::size_t n) {
+      ++nreads;
+      return ::pread(fd.fd, out, n, block_offset);
+    };
+    std::string buffer(size, '\0');
+    buffer.resize(cache->read<PositionalFd>(handler, offset, &buffer[0], size, reader));
+    return buffer;
+  }
+};
+
+constexpr std::size_t BlockCacheFixture::BLOCK_SIZE;
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE(BlockCacheTest)
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestRead, BlockCacheFixture) {
+  auto handler = manager->getFileHandler(path.path());
+
+  // Spans two blocks
+  BOOST_CHECK_EQUAL(read(*handler, 10, 10), content.substr(10, 10));
+  BOOST_CHECK_EQUAL(nreads, 2);
+  BOOST_CHECK_EQUAL(cache->getSize(), 2 * BLOCK_SIZE);
+
+  // Already there
+  BOOST_CHECK_EQUAL(read(*handler, 0, 32), content.substr(0, 32));
+  BOOST_CHECK_EQUAL(nreads, 2);
+
+  // Past the end of the file
+  BOOST_CHECK_EQUAL(read(*handler, 30, 100), content.substr(30));
+  BOOST_CHECK_EQUAL(nreads, 3);
+  BOOST_CHECK_EQUAL(read(*handler, 100, 10), "");
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestHitWithoutDescriptor, BlockCacheFixture) {
+  auto handler = manager->getFileHandler(path.path());
+  read(*handler, 0, 16);
+
+  // Take all the descriptors, a hit must still work
+  Elements::TempPath other_path1, other_path2;
+  auto               other1  = manager->getFileHandler(other_path1.path());
+  auto               other2  = manager->getFileHandler(other_path2.path());
+  auto               writer1 = other1->getAccessor<int>(FileHandler::kWrite);
+  auto               writer2 = other2->getAccessor<int>(FileHandler::kWrite);
+  BOOST_CHECK_EQUAL(manager->getAvailable(), 0);
+
+  BOOST_CHECK_EQUAL(read(*handler, 0, 16), content.substr(0, 16));
+  BOOST_CHECK_EQUAL(nreads, 1);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestInvalidate, BlockCacheFixture) {
+  auto handler = manager->getFileHandler(path.path());
+  read(*handler, 0, 16);
+
+  // Reading does not invalidate
+  handler->getAccessor<PositionalFd>(FileHandler::kRead);
+  BOOST_CHECK_EQUAL(cache->getSize(), BLOCK_SIZE);
+
+  // Writing does
+  {
+    auto writer = handler->getAccessor<PositionalFd>(FileHandler::kWrite);
+    OpenCloseTrait<PositionalFd>::write(writer->m_fd, "NEW CONTENT");
+  }
+  BOOST_CHECK_EQUAL(cache->getSize(), 0);
+  BOOST_CHECK_EQUAL(read(*handler, 0, 100), "NEW CONTENT");
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestInvalidateOther, BlockCacheFixture) {
+  auto handler = manager->getFileHandler(path.path());
+  read(*handler, 0, 32);
+
+  // Only the blocks of the file written are dropped
+  Elements::TempPath other_path;
+  auto               other = manager->getFileHandler(other_path.path());
+  other->getAccessor<PositionalFd>(FileHandler::kWrite);
+  BOOST_CHECK_EQUAL(cache->getSize(), 2 * BLOCK_SIZE);
+  cache->invalidate(other_path.path());
+  BOOST_CHECK_EQUAL(cache->getSize(), 2 * BLOCK_SIZE);
+
+  cache->invalidate(path.path());
+  BOOST_CHECK_EQUAL(cache->getSize(), 0);
+  BOOST_CHECK_EQUAL(read(*handler, 0, 32), content.substr(0, 32));
+  BOOST_CHECK_EQUAL(nreads, 4);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestAppend, BlockCacheFixture) {
+  auto handler = manager->getFileHandler(path.path());
+
+  // The last block is short, so it is not kept
+  BOOST_CHECK_EQUAL(read(*handler, 32, 16), content.substr(32));
+  BOOST_CHECK_EQUAL(cache->getSize(), 0);
+
+  // Appended without going through the handler, so nothing is invalidated
+  {
+    std::ofstream stream(path.path().native(), std::ios::app);
+    stream << "XYZ";
+  }
+  BOOST_CHECK_EQUAL(read(*handler, 32, 16), content.substr(32) + "XYZ");
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestBudget, BlockCacheFixture) {
+  BlockCache small_cache(2 * BLOCK_SIZE, BLOCK_SIZE, 1);
+  auto       handler = manager->getFileHandler(path.path());
+  char       buffer[BLOCK_SIZE];
+  auto       reader = [](PositionalFd& fd, std::uint64_t offset, char* out, std::size_t n) {
+    return ::pread(fd.fd, out, n, offset);
+  };
+
+  for (std::uint64_t offset = 0; offset < content.size(); offset += BLOCK_SIZE) {
+    small_cache.read<PositionalFd>(*handler, offset, buffer, BLOCK_SIZE, reader);
+    BOOST_CHECK_LE(small_cache.getSize(), small_cache.getBudget());
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE_END()
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/BudgetFileManager.h"
+#include "FilePool/FileHandler.h"
+#include "ElementsKernel/Temporary.h"
+#include <boost/test/unit_test.hpp>
+#include <atomic>
+#include <sys/stat.h>
+#include <thread>
+
+#include "TestFileTraits.h"
+
+using namespace SourceXtractor;
+
+/**
+ * Descriptor that costs as many bytes as the file, as if it was read whole into memory
+ */
+struct SizedFd {
+  int         fd;
+  std::size_t size;
+};
+
+namespace SourceXtractor {
+template <>
+struct OpenCloseTrait<SizedFd> {
+  static SizedFd open(const boost::filesystem::path& path, bool write) {
+    int         fd = OpenCloseTrait<int>::open(path, write);
+    struct stat st;
+    ::fstat(fd, &st);
+    return SizedFd{fd, static_cast<std::size_t>(st.st_size)};
+  }
+
+  static void close(SizedFd& sfd) {
+    OpenCloseTrait<int>::close(sfd.fd);
+  }
+
+  static std::size_t cost(const SizedFd& sfd) {
+    return sfd.size;
+  }
+
+  static std::size_t expectedCost(const boost::filesystem::path& path, bool /*write*/) {
+    struct stat st;
+    ::stat(path.native().c_str(), &st);
+    return st.st_size;
+  }
+};
+}  // namespace SourceXtractor
+
+struct BudgetFixture {
+  static constexpr int            NFILES = 5;
+  std::vector<Elements::TempPath> paths;
+
+  /// The first files are small, the last one is big
+  BudgetFixture() : paths(NFILES) {
+    for (int i = 0; i < NFILES; ++i) {
+      std::ofstream stream(paths[i].path().native());
+      stream << std::string(i < NFILES - 1 ? 20 : 90, 'x');
+    }
+  }
+};
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE(BudgetFileManagerTest)
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLimit, BudgetFixture) {
+  constexpr int LIMIT = 2;
+
+  auto manager = std::make_shared<BudgetFileManager>(LIMIT, 1000);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& path : paths) {
+    handlers.emplace_back(manager->getFileHandler(path.path()));
+  }
+
+  // The budget is big enough, so only the number of files matters
+  for (auto& handler : handlers) {
+    auto accessor = handler->getAccessor<SizedFd>(FileHandler::kRead);
+    BOOST_CHECK(accessor);
+    BOOST_CHECK_LE(manager->getUsed(), LIMIT);
+  }
+  BOOST_CHECK_EQUAL(manager->getUsed(), LIMIT);
+  BOOST_CHECK_EQUAL(manager->getCost(), 20 + 90);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestBudget, BudgetFixture) {
+  auto manager = std::make_shared<BudgetFileManager>(10, 100);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& path : paths) {
+    handlers.emplace_back(manager->getFileHandler(path.path()));
+  }
+
+  for (int i = 0; i < NFILES - 1; ++i) {
+    handlers[i]->getAccessor<SizedFd>(FileHandler::kRead);
+  }
+  BOOST_CHECK_EQUAL(manager->getUsed(), NFILES - 1);
+  BOOST_CHECK_EQUAL(manager->getCost(), 80);
+
+  // The big one displaces all the small ones
+  auto big = handlers.back()->getAccessor<SizedFd>(FileHandler::kRead);
+  BOOST_CHECK_EQUAL(manager->getUsed(), 1);
+  BOOST_CHECK_EQUAL(manager->getCost(), 90);
+
+  // While it is in use, not even a small one fits
+  BOOST_CHECK_THROW(handlers[0]->getAccessor<SizedFd>(FileHandler::kRead), Elements::Exception);
+  BOOST_CHECK_EQUAL(manager->getUsed(), 1);
+  BOOST_CHECK_EQUAL(manager->getCost(), 90);
+
+  // Once released, there is room again
+  big.reset();
+  auto small = handlers[0]->getAccessor<SizedFd>(FileHandler::kRead);
+  auto other = handlers[1]->getAccessor<SizedFd>(FileHandler::kRead);
+  BOOST_CHECK_EQUAL(manager->getUsed(), 2);
+  BOOST_CHECK_EQUAL(manager->getCost(), 40);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(TestCostliestEvicted) {
+  std::vector<Elements::TempPath> paths(4);
+  std::vector<std::size_t>        sizes{10, 60, 10, 30};
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    std::ofstream stream(paths[i].path().native());
+    stream << std::string(sizes[i], 'x');
+  }
+
+  auto manager = std::make_shared<BudgetFileManager>(10, 100);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& path : paths) {
+    handlers.emplace_back(manager->getFileHandler(path.path()));
+  }
+  for (int i = 0; i < 3; ++i) {
+    handlers[i]->getAccessor<SizedFd>(FileHandler::kRead);
+  }
+  BOOST_CHECK_EQUAL(manager->getCost(), 80);
+
+  // Closing the least recently used would be enough, but the costliest one is closed instead
+  handlers[3]->getAccessor<SizedFd>(FileHandler::kRead);
+  BOOST_CHECK_EQUAL(manager->getUsed(), 3);
+  BOOST_CHECK_EQUAL(manager->getCost(), 50);
+  BOOST_CHECK_EQUAL(handlers[0]->getCounters().m_forced_closes, 0);
+  BOOST_CHECK_EQUAL(handlers[1]->getCounters().m_forced_closes, 1);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestBudgetNeverExceeded, BudgetFixture) {
+  constexpr std::size_t BUDGET = 100;
+
+  auto manager = std::make_shared<BudgetFileManager>(10, BUDGET);
+  manager->setWaitForRelease(true, std::chrono::seconds(10));
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& path : paths) {
+    handlers.emplace_back(manager->getFileHandler(path.path()));
+  }
+
+  // Each accessor is checked while still held, so its cost is in
+  std::atomic<std::size_t> max_cost(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([t, &handlers, &manager, &max_cost]() {
+      for (int i = 0; i < 50; ++i) {
+        auto        accessor = handlers[(t + i) % handlers.size()]->getAccessor<SizedFd>(FileHandler::kRead);
+        std::size_t cost     = manager->getCost();
+        std::size_t seen     = max_cost.load();
+        while (cost > seen && !max_cost.compare_exchange_weak(seen, cost)) {
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  BOOST_CHECK_LE(max_cost.load(), BUDGET);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestNoCost, BudgetFixture) {
+  auto manager = std::make_shared<BudgetFileManager>(10, 1);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& path : paths) {
+    handlers.emplace_back(manager->getFileHandler(path.path()));
+  }
+
+  // Descriptors without a declared cost only count as files
+  std::vector<std::unique_ptr<FileAccessor<int>>> accessors;
+  for (auto& handler : handlers) {
+    accessors.emplace_back(handler->getAccessor<int>(FileHandler::kRead));
+  }
+  BOOST_CHECK_EQUAL(manager->getUsed(), paths.size());
+  BOOST_CHECK_EQUAL(manager->getCost(), 0);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE_END()
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/ClockFileManager.h"
+#include "ElementsKernel/Temporary.h"
+#include <boost/test/unit_test.hpp>
+
+#include "TestFileTraits.h"
+
+using namespace SourceXtractor;
+
+struct ClockFixture {
+  static constexpr int            NFILES = 5;
+  std::vector<Elements::TempPath> paths;
+
+  ClockFixture() : paths(NFILES) {
+    for (auto& path : paths) {
+      std::ofstream stream(path.path().native());
+      stream << "THIS IS FILE " << path.path().native();
+    }
+  }
+};
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE(ClockFileManagerTest)
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestClock, ClockFixture) {
+  constexpr int LIMIT = 3;
+
+  ClockFileManager                   manager(LIMIT);
+  std::map<FileManager::FileId, int> descriptors;
+  std::vector<FileManager::FileId>   order_closed;
+
+  auto close_callback = [&](FileManager::FileId id) mutable {
+    order_closed.push_back(id);
+    auto iter = descriptors.find(id);
+    manager.close(iter->first, iter->second);
+    descriptors.erase(iter);
+    return true;
+  };
+
+  // Without any use, this behaves as a FIFO
+  std::vector<FileManager::FileId> order_opened;
+  for (auto& path : paths) {
+    auto pair = manager.open<int>(path.path(), false, close_callback);
+    descriptors.emplace(pair);
+    order_opened.push_back(pair.first);
+  }
+
+  BOOST_REQUIRE_EQUAL(order_closed.size(), NFILES - LIMIT);
+  for (int i = 0; i < NFILES - LIMIT; ++i) {
+    BOOST_CHECK_EQUAL(order_opened[i], order_closed[i]);
+  }
+  BOOST_CHECK_EQUAL(manager.getUsed(), LIMIT);
+  BOOST_CHECK_EQUAL(manager.getAvailable(), 0);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestSecondChance, ClockFixture) {
+  constexpr int LIMIT = 3;
+
+  ClockFileManager                   manager(LIMIT);
+  std::map<FileManager::FileId, int> descriptors;
+  std::vector<FileManager::FileId>   order_closed;
+
+  auto close_callback = [&](FileManager::FileId id) mutable {
+    order_closed.push_back(id);
+    auto iter = descriptors.find(id);
+    manager.close(iter->first, iter->second);
+    descriptors.erase(iter);
+    return true;
+  };
+
+  std::vector<FileManager::FileId> order_opened;
+  for (auto i = paths.begin(); i != paths.end() && order_opened.size() < 3; ++i) {
+    auto pair = manager.open<int>(i->path(), false, close_callback);
+    descriptors.emplace(pair);
+    order_opened.push_back(pair.first);
+  }
+
+  // The first one has been used, so it gets a second chance
+  manager.notifyUsed(order_opened[0]);
+
+  auto pair = manager.open<int>(paths[3].path(), false, close_callback);
+  descriptors.emplace(pair);
+
+  BOOST_REQUIRE_EQUAL(order_closed.size(), 1);
+  BOOST_CHECK_EQUAL(order_closed[0], order_opened[1]);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestRefuse, ClockFixture) {
+  constexpr int LIMIT = 2;
+
+  ClockFileManager                   manager(LIMIT);
+  std::map<FileManager::FileId, int> descriptors;
+
+  // Everything is in use
+  auto close_callback = [](FileManager::FileId) { return false; };
+
+  for (int i = 0; i < LIMIT; ++i) {
+    descriptors.emplace(manager.open<int>(paths[i].path(), false, close_callback));
+  }
+  BOOST_CHECK_THROW(manager.open<int>(paths[LIMIT].path(), false, close_callback), Elements::Exception);
+
+  for (auto& d : descriptors) {
+    manager.close(d.first, d.second);
+  }
+  BOOST_CHECK_EQUAL(manager.getUsed(), 0);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE_END()
+
+//-----------------------------------------------------------------------------
@@ -19,6 +19,8 @@
 #include "FilePool/FileAccessor.h"
 #include <boost/test/unit_test.hpp>
 
+#include "AllocationCount.h"
+
 using namespace SourceXtractor;
 
 // This struct can not be copied or assigned, only moved
@@ -88,6 +90,66 @@ BOOST_AUTO_TEST_CASE(WriteTest) {
 
 //-----------------------------------------------------------------------------
 
+BOOST_AUTO_TEST_CASE(UpgradableTest) {
+  boost::shared_mutex mutex;
+  int                 release_flags = 0;
+  bool                upgraded      = false;
+  auto                callback      = [&release_flags](NonCopyableFd&& fd) { release_flags |= fd.m_fd; };
+
+  {
+    FileUpgradableAccessor<NonCopyableFd> a1(1, callback, boost::upgrade_lock<boost::shared_mutex>(mutex),
+                                             [&upgraded]() { upgraded = true; });
+    BOOST_CHECK(a1.isReadOnly());
+
+    // Readers can get in, but no other upgradable nor writer
+    BOOST_CHECK(mutex.try_lock_shared());
+    mutex.unlock_shared();
+    BOOST_CHECK(!mutex.try_lock_upgrade());
+    BOOST_CHECK(!mutex.try_lock());
+
+    // Once upgraded, not even readers
+    a1.upgrade();
+    BOOST_CHECK(upgraded);
+    BOOST_CHECK(!a1.isReadOnly());
+    BOOST_CHECK(!mutex.try_lock_shared());
+    BOOST_CHECK_EQUAL(a1.m_fd.m_fd, 1);
+    BOOST_CHECK_EQUAL(release_flags, 0);
+  }
+
+  BOOST_CHECK(mutex.try_lock());
+  BOOST_CHECK_EQUAL(release_flags, 1);
+}
+
+BOOST_AUTO_TEST_CASE(RecycledTest) {
+  boost::shared_mutex mutex;
+  int                 release_flags = 0;
+  auto                callback      = [&release_flags](NonCopyableFd&& fd) { release_flags |= fd.m_fd; };
+
+  // The memory of a released accessor is reused by the next one
+  std::unique_ptr<FileAccessor<NonCopyableFd>> a1(
+      new FileReadAccessor<NonCopyableFd>(1, callback, boost::shared_lock<boost::shared_mutex>(mutex)));
+  void* address = a1.get();
+  a1.reset();
+
+  std::unique_ptr<FileAccessor<NonCopyableFd>> a2(
+      new FileReadAccessor<NonCopyableFd>(2, callback, boost::shared_lock<boost::shared_mutex>(mutex)));
+  BOOST_CHECK_EQUAL(a2.get(), address);
+  a2.reset();
+
+  BOOST_CHECK_EQUAL(release_flags, 3);
+
+  // Once there is a free block, a round trip does not allocate at all
+  auto allocations = allocationCount();
+  for (int i = 0; i < 100; ++i) {
+    std::unique_ptr<FileAccessor<NonCopyableFd>> a3(
+        new FileReadAccessor<NonCopyableFd>(4, callback, boost::shared_lock<boost::shared_mutex>(mutex)));
+  }
+  BOOST_CHECK_EQUAL(allocationCount() - allocations, 0u);
+  BOOST_CHECK_EQUAL(release_flags, 7);
+}
+
+//-----------------------------------------------------------------------------
+
 BOOST_AUTO_TEST_SUITE_END()
 
 //-----------------------------------------------------------------------------
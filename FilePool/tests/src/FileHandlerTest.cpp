@@ -20,7 +20,11 @@
 #include "ElementsKernel/Temporary.h"
 #include <boost/mpl/list.hpp>
 #include <boost/test/unit_test.hpp>
+#include <future>
+#include <thread>
+#include <unistd.h>
 
+#include "AllocationCount.h"
 #include "TestFileTraits.h"
 
 using namespace SourceXtractor;
@@ -30,13 +34,13 @@ using namespace SourceXtractor;
  */
 struct FileManagerMock : public FileManager {
 protected:
-  void notifyIntentToOpen(bool) override {
+  void notifyIntentToOpen(bool, unsigned count) override {
     BOOST_CHECK_EQUAL(n_notified, n_opened);
-    ++n_notified;
+    n_notified += count;
   }
 
   void notifyOpenedFile(FileId file_id) override {
-    BOOST_CHECK_EQUAL(n_notified, n_opened + 1);
+    BOOST_CHECK_LT(n_opened, n_notified);
     ++n_opened;
     auto iter = m_files.find(file_id);
     BOOST_REQUIRE(iter != m_files.end());
@@ -46,13 +50,17 @@ protected:
     BOOST_CHECK_LE(n_closed, n_opened);
     ++n_closed;
     auto iter = m_files.find(file_id);
-    BOOST_REQUIRE(iter != m_files.end());
+    BOOST_REQUIRE(iter == m_files.end());
   }
 
   void notifyUsed(FileId) override {
     ++n_used;
   }
 
+  void notifyOpenFailed(bool) override {
+    --n_notified;
+  }
+
 public:
   FileManagerMock() : n_opened(0), n_closed(0), n_notified(0), n_used(0) {}
 
@@ -69,6 +77,66 @@ struct FileHandlerFixture {
   FileHandlerFixture() : m_file_manager(std::make_shared<FileManagerMock>()) {}
 };
 
+/**
+ * Descriptor type that keeps track of the advices it is given
+ */
+struct AdvisedFd {
+  int fd;
+};
+
+struct Advice {
+  int   advice;
+  off_t offset, length;
+};
+
+namespace SourceXtractor {
+template <>
+struct OpenCloseTrait<AdvisedFd> {
+  static std::mutex          mutex;
+  static std::vector<Advice> advices;
+
+  static AdvisedFd open(const boost::filesystem::path& path, bool write) {
+    return AdvisedFd{OpenCloseTrait<int>::open(path, write)};
+  }
+
+  static void close(AdvisedFd& afd) {
+    OpenCloseTrait<int>::close(afd.fd);
+  }
+
+  static void advise(AdvisedFd&, int advice, off_t offset, off_t length) {
+    std::lock_guard<std::mutex> lock(mutex);
+    advices.push_back(Advice{advice, offset, length});
+  }
+};
+
+std::mutex          OpenCloseTrait<AdvisedFd>::mutex;
+std::vector<Advice> OpenCloseTrait<AdvisedFd>::advices;
+}  // namespace SourceXtractor
+
+/**
+ * Descriptor type that fails to open when told to, so a thread can be kept in the middle of opening
+ */
+struct FailingFd {};
+
+namespace SourceXtractor {
+template <>
+struct OpenCloseTrait<FailingFd> {
+  static std::promise<void>*     opening;
+  static std::shared_future<void> fail;
+
+  static FailingFd open(const boost::filesystem::path&, bool) {
+    opening->set_value();
+    fail.wait();
+    throw Elements::Exception() << "Failed on purpose";
+  }
+
+  static void close(FailingFd&) {}
+};
+
+std::promise<void>*      OpenCloseTrait<FailingFd>::opening;
+std::shared_future<void> OpenCloseTrait<FailingFd>::fail;
+}  // namespace SourceXtractor
+
 /**
  * Run the tests for this set of types
  */
@@ -236,6 +304,396 @@ BOOST_FIXTURE_TEST_CASE(ReadDifferentTypes2, FileHandlerFixture) {
 
 //-----------------------------------------------------------------------------
 
+BOOST_FIXTURE_TEST_CASE(ReuseByType, FileHandlerFixture) {
+  auto        handler = m_file_manager->getFileHandler(m_path.path());
+  std::string content("Genève est à nouveau la capitale suisse du bouchon");
+
+  {
+    auto write_accessor = handler->getAccessor<int>(FileHandler::kWrite);
+    OpenCloseTrait<int>::write(write_accessor->m_fd, content);
+  }
+
+  // One descriptor of each type is opened, and then reused regardless of the order
+  for (int i = 0; i < 3; ++i) {
+    BOOST_CHECK(handler->getAccessor<CfitsioLike*>(FileHandler::kRead));
+    BOOST_CHECK(handler->getAccessor<int>(FileHandler::kRead));
+  }
+
+  BOOST_CHECK_EQUAL(m_file_manager->n_closed, 1);
+  BOOST_CHECK_EQUAL(m_file_manager->n_opened, 3);
+  BOOST_CHECK_EQUAL(m_file_manager->n_used, 7);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(KeepOnModeSwitch, FileHandlerFixture) {
+  auto        handler = m_file_manager->getFileHandler(m_path.path());
+  std::string content("Genève est à nouveau la capitale suisse du bouchon");
+
+  handler->setKeepOnModeSwitch(true);
+
+  // One descriptor per mode is opened, and none is closed when switching back and forth
+  for (int i = 0; i < 3; ++i) {
+    {
+      auto write_accessor = handler->getAccessor<int>(FileHandler::kWrite);
+      BOOST_CHECK(!handler->isReadOnly());
+      if (i == 0)
+        OpenCloseTrait<int>::write(write_accessor->m_fd, content);
+    }
+    {
+      auto read_accessor = handler->getAccessor<int>(FileHandler::kRead);
+      BOOST_CHECK(handler->isReadOnly());
+      if (i == 0)
+        BOOST_CHECK_EQUAL(OpenCloseTrait<int>::read(read_accessor->m_fd), content);
+    }
+  }
+
+  BOOST_CHECK_EQUAL(m_file_manager->n_opened, 2);
+  BOOST_CHECK_EQUAL(m_file_manager->n_closed, 0);
+
+  // A different type still replaces the write descriptor
+  handler->getAccessor<CfitsioLike*>(FileHandler::kWrite);
+  BOOST_CHECK_EQUAL(m_file_manager->n_opened, 3);
+  BOOST_CHECK_EQUAL(m_file_manager->n_closed, 1);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(UpgradableTest, FileHandlerFixture) {
+  auto        handler = m_file_manager->getFileHandler(m_path.path());
+  std::string content("Genève est à nouveau la capitale suisse du bouchon");
+
+  // Create the file
+  OpenCloseTrait<int>::write(handler->getAccessor<int>(FileHandler::kWrite)->m_fd, "precious content");
+
+  auto read_accessor = handler->getAccessor<int>(FileHandler::kRead);
+  {
+    // Can coexist with a reader, but not with a writer
+    auto upgradable = handler->getUpgradableAccessor<int>();
+    BOOST_REQUIRE(upgradable);
+    BOOST_CHECK(upgradable->isReadOnly());
+    BOOST_CHECK(handler->isReadOnly());
+    BOOST_CHECK(handler->getAccessor<int>(FileHandler::kTryWrite) == nullptr);
+    BOOST_CHECK(handler->getUpgradableAccessor<int>(true) == nullptr);
+
+    // Until upgraded, the file is left as it is, for the reader and for itself
+    BOOST_CHECK_EQUAL(OpenCloseTrait<int>::read(read_accessor->m_fd), "precious content");
+    BOOST_CHECK_EQUAL(OpenCloseTrait<int>::read(upgradable->m_fd), "precious content");
+
+    // Upgrade once the reader is gone, keeping the descriptor
+    read_accessor.reset();
+    upgradable->upgrade();
+    BOOST_CHECK(!upgradable->isReadOnly());
+    BOOST_CHECK(!handler->isReadOnly());
+    ::lseek(upgradable->m_fd, 0, SEEK_SET);
+    OpenCloseTrait<int>::write(upgradable->m_fd, content);
+
+    BOOST_CHECK_EQUAL(m_file_manager->n_opened, 3);
+    BOOST_CHECK_EQUAL(m_file_manager->n_closed, 1);
+  }
+
+  // The write descriptor is reused by a writer
+  handler->getAccessor<int>(FileHandler::kWrite);
+  BOOST_CHECK_EQUAL(m_file_manager->n_opened, 3);
+
+  // And a new reader sees the content
+  auto reader = handler->getAccessor<int>(FileHandler::kRead);
+  BOOST_CHECK_EQUAL(OpenCloseTrait<int>::read(reader->m_fd), content);
+
+  // Trying succeeds when there is no writer
+  BOOST_CHECK(handler->getAccessor<int>(FileHandler::kTryRead));
+  BOOST_CHECK(handler->getUpgradableAccessor<int>(true));
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(SharedReadersTest, FileHandlerFixture) {
+  auto        handler = m_file_manager->getFileHandler(m_path.path());
+  std::string content("Genève est à nouveau la capitale suisse du bouchon");
+
+  {
+    auto write_accessor = handler->getAccessor<PositionalFd>(FileHandler::kWrite);
+    OpenCloseTrait<PositionalFd>::write(write_accessor->m_fd, content);
+  }
+
+  // All the readers use the same descriptor
+  std::vector<std::unique_ptr<FileAccessor<PositionalFd>>> readers;
+  for (int i = 0; i < 3; ++i) {
+    readers.emplace_back(handler->getAccessor<PositionalFd>(FileHandler::kRead));
+    BOOST_CHECK_EQUAL(readers.back()->m_fd.fd, readers.front()->m_fd.fd);
+    BOOST_CHECK_EQUAL(OpenCloseTrait<PositionalFd>::read(readers.back()->m_fd), content);
+  }
+  BOOST_CHECK_EQUAL(m_file_manager->n_opened, 2);
+  BOOST_CHECK_EQUAL(m_file_manager->n_used, 4);
+
+  // It can not be closed while any of them is alive
+  auto fd = readers.front()->m_fd.fd;
+  readers.pop_back();
+  readers.pop_back();
+  BOOST_CHECK_EQUAL(::fcntl(fd, F_GETFD), 0);
+  readers.clear();
+
+  // But it is reused afterwards
+  BOOST_CHECK_EQUAL(handler->getAccessor<PositionalFd>(FileHandler::kRead)->m_fd.fd, fd);
+  BOOST_CHECK_EQUAL(m_file_manager->n_opened, 2);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(HintTest, FileHandlerFixture) {
+  auto  handler = m_file_manager->getFileHandler(m_path.path());
+  auto& advices = OpenCloseTrait<AdvisedFd>::advices;
+  advices.clear();
+
+  handler->getAccessor<AdvisedFd>(FileHandler::kWrite);
+  BOOST_CHECK_EQUAL(advices.size(), 0);
+
+  // The access pattern is only given when it changes
+  handler->getAccessor<AdvisedFd>(FileHandler::kRead, FileHandler::kSequential);
+  handler->getAccessor<AdvisedFd>(FileHandler::kRead, FileHandler::kSequential);
+  BOOST_REQUIRE_EQUAL(advices.size(), 1);
+  BOOST_CHECK_EQUAL(advices[0].advice, POSIX_FADV_SEQUENTIAL);
+  handler->getAccessor<AdvisedFd>(FileHandler::kRead);
+  BOOST_REQUIRE_EQUAL(advices.size(), 2);
+  BOOST_CHECK_EQUAL(advices[1].advice, POSIX_FADV_NORMAL);
+
+  // Will need is given on acquisition, don't need on release
+  {
+    auto accessor = handler->getAccessor<AdvisedFd>(FileHandler::kRead, FileHandler::kWillNeed);
+    BOOST_REQUIRE_EQUAL(advices.size(), 3);
+    BOOST_CHECK_EQUAL(advices[2].advice, POSIX_FADV_WILLNEED);
+  }
+  {
+    auto accessor = handler->getAccessor<AdvisedFd>(FileHandler::kRead, FileHandler::kDontNeed);
+    BOOST_CHECK_EQUAL(advices.size(), 3);
+  }
+  BOOST_REQUIRE_EQUAL(advices.size(), 4);
+  BOOST_CHECK_EQUAL(advices[3].advice, POSIX_FADV_DONTNEED);
+  BOOST_CHECK_EQUAL(m_file_manager->n_opened, 2);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(PrefetchTest, FileHandlerFixture) {
+  auto  handler = m_file_manager->getFileHandler(m_path.path());
+  auto& advices = OpenCloseTrait<AdvisedFd>::advices;
+  handler->getAccessor<AdvisedFd>(FileHandler::kWrite);
+  handler->getAccessor<AdvisedFd>(FileHandler::kRead);
+  {
+    std::lock_guard<std::mutex> lock(OpenCloseTrait<AdvisedFd>::mutex);
+    advices.clear();
+  }
+
+  // The background tasks run in order, so this one is done after the ones queued before
+  auto wait_background = [this]() {
+    std::promise<void> done;
+    m_file_manager->runInBackground([&done]() { done.set_value(); });
+    BOOST_REQUIRE(done.get_future().wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+  };
+
+  handler->prefetch<AdvisedFd>(1024, 4096);
+  wait_background();
+
+  BOOST_REQUIRE_EQUAL(advices.size(), 1);
+  BOOST_CHECK_EQUAL(advices[0].advice, POSIX_FADV_WILLNEED);
+  BOOST_CHECK_EQUAL(advices[0].offset, 1024);
+  BOOST_CHECK_EQUAL(advices[0].length, 4096);
+
+  // The descriptor used by the prefetch is kept
+  handler->getAccessor<AdvisedFd>(FileHandler::kRead);
+  BOOST_CHECK_EQUAL(m_file_manager->n_opened, 2);
+
+  // Descriptor types without hints are not opened
+  handler->prefetch<CfitsioLike*>();
+  BOOST_CHECK_EQUAL(m_file_manager->n_opened, 2);
+
+  // A prefetch does not close the descriptor of a writer
+  handler->getAccessor<AdvisedFd>(FileHandler::kWrite);
+  handler->prefetch<AdvisedFd>();
+  wait_background();
+  BOOST_CHECK_EQUAL(advices.size(), 1);
+  BOOST_CHECK_EQUAL(m_file_manager->n_opened, 3);
+  BOOST_CHECK_EQUAL(m_file_manager->n_closed, 2);
+  BOOST_CHECK(!handler->isReadOnly());
+
+  // Nor does it bring back a handler that is gone
+  std::promise<void> blocker;
+  auto               blocked = blocker.get_future().share();
+  m_file_manager->runInBackground([blocked]() { blocked.wait(); });
+  handler->prefetch<AdvisedFd>();
+  handler.reset();
+  blocker.set_value();
+  wait_background();
+  BOOST_CHECK_EQUAL(advices.size(), 1);
+  BOOST_CHECK_EQUAL(m_file_manager->n_opened, 3);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(AllocationTest, FileHandlerFixture) {
+  auto handler = m_file_manager->getFileHandler(m_path.path());
+  handler->getAccessor<int>(FileHandler::kWrite);
+
+  // The first round opens the descriptors and fills the free lists
+  auto cycle = [&handler]() {
+    handler->getAccessor<int>(FileHandler::kRead);
+    handler->getAccessor<int>(FileHandler::kRead, FileHandler::kSequential);
+    handler->getAccessor<int>(FileHandler::kRead, FileHandler::kDontNeed);
+    handler->getAccessor<PositionalFd>(FileHandler::kRead, FileHandler::kDontNeed);
+  };
+  cycle();
+
+  // Afterwards, acquiring and releasing does not allocate
+  auto allocations = allocationCount();
+  for (int i = 0; i < 100; ++i) {
+    cycle();
+  }
+  BOOST_CHECK_EQUAL(allocationCount() - allocations, 0u);
+
+  handler->getAccessor<int>(FileHandler::kWrite, FileHandler::kDontNeed);
+  allocations = allocationCount();
+  for (int i = 0; i < 100; ++i) {
+    handler->getAccessor<int>(FileHandler::kWrite);
+    handler->getAccessor<int>(FileHandler::kWrite, FileHandler::kDontNeed);
+  }
+  BOOST_CHECK_EQUAL(allocationCount() - allocations, 0u);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(AsyncTest, FileHandlerFixture) {
+  auto handler = m_file_manager->getFileHandler(m_path.path());
+
+  // Free, so it is served right away
+  auto writer = handler->getAccessorAsync<int>(FileHandler::kWrite).get();
+  BOOST_REQUIRE(writer);
+
+  // Parked until the writer is released
+  auto reader_future = handler->getAccessorAsync<int>(FileHandler::kRead);
+  auto writer_future = handler->getAccessorAsync<int>(FileHandler::kWrite);
+  BOOST_CHECK(reader_future.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+  BOOST_CHECK(writer_future.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+
+  // Served in order: the reader first, and the second writer waits for it
+  writer.reset();
+  BOOST_REQUIRE(reader_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+  BOOST_CHECK(writer_future.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+  auto reader = reader_future.get();
+  BOOST_CHECK(reader->isReadOnly());
+
+  // A reader arriving later does not overtake the writer
+  auto late_reader = handler->getAccessorAsync<int>(FileHandler::kRead);
+  BOOST_CHECK(late_reader.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+
+  reader.reset();
+  BOOST_REQUIRE(writer_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+  BOOST_CHECK(!writer_future.get()->isReadOnly());
+  BOOST_REQUIRE(late_reader.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+  BOOST_CHECK(late_reader.get());
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(AsyncOpenFailedTest, FileHandlerFixture) {
+  auto               handler = m_file_manager->getFileHandler(m_path.path());
+  std::promise<void> opening, fail;
+  OpenCloseTrait<FailingFd>::opening = &opening;
+  OpenCloseTrait<FailingFd>::fail    = fail.get_future().share();
+
+  // The lock of the file is held while opening
+  auto reader = std::async(std::launch::async, [&handler]() { handler->getAccessor<FailingFd>(FileHandler::kRead); });
+  opening.get_future().wait();
+  auto writer = handler->getAccessorAsync<int>(FileHandler::kWrite);
+  BOOST_CHECK(writer.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
+
+  // Releasing the lock because opening failed also serves the requests
+  fail.set_value();
+  BOOST_CHECK_THROW(reader.get(), Elements::Exception);
+  BOOST_REQUIRE(writer.wait_for(std::chrono::seconds(10)) == std::future_status::ready);
+  BOOST_CHECK(writer.get());
+
+  // Attempts of the parked request are not failures of kTry
+  BOOST_CHECK_EQUAL(handler->getCounters().m_try_failed, 0);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(CountersTest, FileHandlerFixture) {
+  auto handler = m_file_manager->getFileHandler(m_path.path());
+
+  auto writer = handler->getAccessor<int>(FileHandler::kWrite);
+  BOOST_CHECK(!handler->getAccessor<int>(FileHandler::kTryRead));
+
+  // The reader blocks until the writer is gone
+  std::thread thread([&writer]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    writer.reset();
+  });
+  auto reader = handler->getAccessor<int>(FileHandler::kRead);
+  thread.join();
+  reader.reset();
+  handler->getAccessor<int>(FileHandler::kRead);
+
+  auto counters = handler->getCounters();
+  BOOST_CHECK_EQUAL(counters.m_write_acquired, 1);
+  BOOST_CHECK_EQUAL(counters.m_read_acquired, 2);
+  BOOST_CHECK_EQUAL(counters.m_try_failed, 1);
+  BOOST_CHECK_EQUAL(counters.m_opened, 2);
+  BOOST_CHECK_EQUAL(counters.m_reused, 1);
+  BOOST_CHECK_EQUAL(counters.m_forced_closes, 0);
+  BOOST_CHECK(counters.m_lock_wait >= std::chrono::milliseconds(10));
+
+  // The manager adds up the handlers, even once they are gone
+  handler.reset();
+  auto total = m_file_manager->getCounters().m_handlers;
+  BOOST_CHECK_EQUAL(total.m_read_acquired, counters.m_read_acquired);
+  BOOST_CHECK_EQUAL(total.m_opened, counters.m_opened);
+}
+
+//-----------------------------------------------------------------------------
+
+#ifdef FILEPOOL_HAS_COROUTINES
+/// Minimal eagerly started coroutine
+struct Task {
+  struct promise_type {
+    Task get_return_object() {
+      return {};
+    }
+    std::suspend_never initial_suspend() {
+      return {};
+    }
+    std::suspend_never final_suspend() noexcept {
+      return {};
+    }
+    void return_void() {}
+    void unhandled_exception() {
+      std::terminate();
+    }
+  };
+};
+
+static Task readWhenFree(std::shared_ptr<FileHandler> handler, bool& done) {
+  auto accessor = co_await handler->awaitAccessor<int>(FileHandler::kRead);
+  BOOST_CHECK(accessor->isReadOnly());
+  done = true;
+}
+
+BOOST_FIXTURE_TEST_CASE(AwaitTest, FileHandlerFixture) {
+  auto handler = m_file_manager->getFileHandler(m_path.path());
+  auto writer  = handler->getAccessor<int>(FileHandler::kWrite);
+
+  bool done = false;
+  readWhenFree(handler, done);
+  BOOST_CHECK(!done);
+
+  // The coroutine is resumed when the writer is released
+  writer.reset();
+  BOOST_CHECK(done);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+
 BOOST_AUTO_TEST_SUITE_END()
 
 //-----------------------------------------------------------------------------
@@ -19,6 +19,8 @@
 #include "FilePool/FileManager.h"
 #include "ElementsKernel/Temporary.h"
 #include <boost/test/unit_test.hpp>
+#include <fstream>
+#include <thread>
 
 #include "TestFileTraits.h"
 
@@ -32,7 +34,7 @@ public:
   FileManagerFixture() {}
 
 protected:
-  void notifyIntentToOpen(bool) final {}
+  void notifyIntentToOpen(bool, unsigned) final {}
   void notifyOpenedFile(FileId) final {}
   void notifyClosedFile(FileId) final {}
 };
@@ -141,6 +143,108 @@ BOOST_FIXTURE_TEST_CASE(NewHandlerTest, FileManagerFixture) {
 
 //-----------------------------------------------------------------------------
 
+BOOST_FIXTURE_TEST_CASE(HardlinkSameHandlerTest, FileManagerFixture) {
+  Elements::TempDir dir;
+  auto              original = dir.path() / "original";
+  auto              hardlink = dir.path() / "hardlink";
+  std::ofstream(original.native()).close();
+  create_hard_link(original, hardlink);
+
+  auto handler1 = getFileHandler(original);
+
+  BOOST_CHECK(hasHandler(hardlink));
+
+  auto handler2 = getFileHandler(hardlink);
+
+  BOOST_CHECK(handler1);
+  BOOST_CHECK_EQUAL(handler1, handler2);
+  BOOST_CHECK_EQUAL(handler2->getPath(), weakly_canonical(original));
+
+  // Once gone, the inode is forgotten too
+  handler1.reset();
+  handler2.reset();
+  BOOST_CHECK(!hasHandler(original));
+  BOOST_CHECK(!hasHandler(hardlink));
+}
+
+//----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(CachedResolutionTest, FileManagerFixture) {
+  Elements::TempDir dir;
+  auto              target1 = dir.path() / "target1";
+  auto              target2 = dir.path() / "target2";
+  auto              link    = dir.path() / "link";
+  std::ofstream(target1.native()).close();
+  std::ofstream(target2.native()).close();
+  create_symlink(target1, link);
+
+  auto handler1 = getFileHandler(link);
+  BOOST_CHECK_EQUAL(handler1->getPath(), weakly_canonical(target1));
+
+  // While the handler is alive, the link is not resolved again
+  remove(link);
+  create_symlink(target2, link);
+  BOOST_CHECK_EQUAL(getFileHandler(link), handler1);
+
+  // Once it is gone, the resolution is forgotten
+  handler1.reset();
+  BOOST_CHECK(!hasHandler(target1));
+  auto handler2 = getFileHandler(link);
+  BOOST_CHECK_EQUAL(handler2->getPath(), weakly_canonical(target2));
+}
+
+//----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(ConcurrentHandlerTest, FileManagerFixture) {
+  constexpr int NFILES = 8, NTHREADS = 4;
+
+  Elements::TempDir dir;
+
+  // Every thread must get the same handler for the same file, however they race
+  std::vector<std::vector<std::shared_ptr<FileHandler>>> handlers(NTHREADS);
+  std::vector<std::thread>                               threads;
+  for (int t = 0; t < NTHREADS; ++t) {
+    threads.emplace_back([this, t, &dir, &handlers]() {
+      for (int i = 0; i < 100; ++i) {
+        for (int f = 0; f < NFILES; ++f) {
+          auto handler = getFileHandler(dir.path() / std::to_string((f + t) % NFILES));
+          if (i == 0)
+            handlers[t].push_back(handler);
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (int t = 1; t < NTHREADS; ++t) {
+    for (int f = 0; f < NFILES; ++f) {
+      BOOST_CHECK_EQUAL(handlers[t][(f + NFILES - t) % NFILES], handlers[0][f]);
+    }
+  }
+}
+
+//----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(LatencyHistogramTest) {
+  LatencyHistogram histogram;
+  histogram.record(std::chrono::nanoseconds(0));
+  histogram.record(std::chrono::nanoseconds(1));
+  histogram.record(std::chrono::nanoseconds(1000));
+  histogram.record(std::chrono::hours(1));
+
+  // 1000 ns is between 2^9 and 2^10
+  auto counts = histogram.getCounts();
+  BOOST_REQUIRE_EQUAL(counts.size(), LatencyHistogram::kBuckets);
+  BOOST_CHECK_EQUAL(counts[0], 2);
+  BOOST_CHECK_EQUAL(counts[9], 1);
+  BOOST_CHECK_EQUAL(counts.back(), 1);
+  BOOST_CHECK(LatencyHistogram::upperBound(9) == std::chrono::nanoseconds(1024));
+}
+
+//----------------------------------------------------------------------------
+
 BOOST_AUTO_TEST_SUITE_END()
 
 //-----------------------------------------------------------------------------
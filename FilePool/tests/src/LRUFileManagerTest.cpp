@@ -17,8 +17,13 @@
  */
 
 #include "FilePool/LRUFileManager.h"
+#include "FilePool/FileHandler.h"
 #include "ElementsKernel/Temporary.h"
 #include <boost/test/unit_test.hpp>
+#include <condition_variable>
+#include <numeric>
+#include <set>
+#include <thread>
 
 #include "TestFileTraits.h"
 
@@ -123,6 +128,57 @@ BOOST_FIXTURE_TEST_CASE(TestLRUMultiple, LRUFixture) {
 
 //-----------------------------------------------------------------------------
 
+BOOST_FIXTURE_TEST_CASE(TestLRUSkipInUse, LRUFixture) {
+  constexpr int LIMIT = 3;
+
+  LRUFileManager                     manager(LIMIT);
+  std::map<FileManager::FileId, int> descriptors;
+  std::set<FileManager::FileId>      in_use;
+  std::vector<FileManager::FileId>   order_requested;
+
+  auto close_callback = [&](FileManager::FileId id) mutable {
+    order_requested.push_back(id);
+    if (in_use.count(id))
+      return false;
+    auto iter = descriptors.find(id);
+    manager.close(iter->first, iter->second);
+    descriptors.erase(iter);
+    return true;
+  };
+
+  std::vector<FileManager::FileId> order_opened;
+  for (int i = 0; i < LIMIT; ++i) {
+    auto pair = manager.open<int>(paths[i].path(), false, close_callback);
+    descriptors.emplace(pair);
+    order_opened.push_back(pair.first);
+  }
+
+  // The two oldest are handed to an accessor, so only the third can be closed
+  for (int i = 0; i < 2; ++i) {
+    manager.notifyAcquired(order_opened[i]);
+    in_use.insert(order_opened[i]);
+  }
+  auto pair = manager.open<int>(paths[3].path(), false, close_callback);
+  descriptors.emplace(pair);
+
+  // The files in use must not even be asked
+  BOOST_REQUIRE_EQUAL(order_requested.size(), 1);
+  BOOST_CHECK_EQUAL(order_requested[0], order_opened[2]);
+
+  // Once released, the second is the only one idle
+  manager.notifyAcquired(pair.first);
+  in_use.insert(pair.first);
+  in_use.erase(order_opened[1]);
+  manager.notifyReleased(order_opened[1]);
+  manager.open<int>(paths[4].path(), false, close_callback);
+
+  BOOST_REQUIRE_EQUAL(order_requested.size(), 2);
+  BOOST_CHECK_EQUAL(order_requested[1], order_opened[1]);
+  BOOST_CHECK_EQUAL(manager.getUsed(), LIMIT);
+}
+
+//-----------------------------------------------------------------------------
+
 BOOST_FIXTURE_TEST_CASE(TestLruMixed, LRUFixture) {
   constexpr int LIMIT = 3;
 
@@ -152,6 +208,528 @@ BOOST_FIXTURE_TEST_CASE(TestLruMixed, LRUFixture) {
 
 //-----------------------------------------------------------------------------
 
+BOOST_FIXTURE_TEST_CASE(TestLRUHandlers, LRUFixture) {
+  constexpr int LIMIT = 2;
+
+  auto manager = std::make_shared<LRUFileManager>(LIMIT);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& path : paths) {
+    handlers.emplace_back(manager->getFileHandler(path.path()));
+  }
+
+  // Descriptors returned to the handlers must be really closed when evicted
+  for (int i = 0; i < 2; ++i) {
+    for (auto& handler : handlers) {
+      auto accessor = handler->getAccessor<int>(FileHandler::kRead);
+      BOOST_CHECK(accessor);
+      BOOST_CHECK_LE(manager->getUsed(), LIMIT);
+    }
+  }
+  BOOST_CHECK_EQUAL(manager->getUsed(), LIMIT);
+}
+
+//-----------------------------------------------------------------------------
+
+/// Lets a test wait for the files closed by the background thread
+struct ClosingListener : public FileEventListener {
+  std::mutex              m_mutex;
+  std::condition_variable m_cv;
+  std::set<std::string>   m_closed;
+  int                     m_opened = 0;
+
+  void onOpen(const boost::filesystem::path&, bool, Duration) override {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_opened;
+  }
+
+  void onClose(const boost::filesystem::path& path, Duration) override {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closed.insert(path.filename().native());
+    }
+    m_cv.notify_all();
+  }
+
+  bool waitClosed(std::size_t count) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_cv.wait_for(lock, std::chrono::seconds(10), [this, count]() { return m_closed.size() >= count; });
+  }
+};
+
+BOOST_FIXTURE_TEST_CASE(TestLRUReaper, LRUFixture) {
+  constexpr int LIMIT     = 4;
+  constexpr int WATERMARK = 2;
+
+  auto manager  = std::make_shared<LRUFileManager>(LIMIT, WATERMARK);
+  auto listener = std::make_shared<ClosingListener>();
+  manager->setEventListener(listener);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& path : paths) {
+    handlers.emplace_back(manager->getFileHandler(path.path()));
+  }
+
+  // While in use, the files can not be closed, so they can go above the watermark
+  {
+    std::vector<std::unique_ptr<FileAccessor<int>>> accessors;
+    for (int i = 0; i < LIMIT; ++i) {
+      accessors.emplace_back(handlers[i]->getAccessor<int>(FileHandler::kRead));
+    }
+    BOOST_CHECK_EQUAL(manager->getUsed(), LIMIT);
+  }
+
+  // Once released, the background thread should bring them down to the watermark, closing the oldest
+  BOOST_REQUIRE(listener->waitClosed(LIMIT - WATERMARK));
+  std::set<std::string> expected{paths[0].path().filename().native(), paths[1].path().filename().native()};
+  BOOST_CHECK(listener->m_closed == expected);
+
+  // The two most recently used are the ones remaining, and re-using them does not need an open
+  auto accessor1 = handlers[LIMIT - 1]->getAccessor<int>(FileHandler::kRead);
+  auto accessor2 = handlers[LIMIT - 2]->getAccessor<int>(FileHandler::kRead);
+  std::lock_guard<std::mutex> lock(listener->m_mutex);
+  BOOST_CHECK_EQUAL(listener->m_opened, LIMIT);
+  BOOST_CHECK_EQUAL(listener->m_closed.size(), LIMIT - WATERMARK);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUReaperDestroyHandlers, LRUFixture) {
+  auto manager = std::make_shared<LRUFileManager>(NFILES, 1);
+
+  // The background thread keeps requesting closes while the handlers go away
+  for (int i = 0; i < 20000; ++i) {
+    std::vector<std::shared_ptr<FileHandler>> handlers;
+    for (auto& path : paths) {
+      handlers.emplace_back(manager->getFileHandler(path.path()));
+      handlers.back()->getAccessor<int>(FileHandler::kRead);
+    }
+  }
+
+  auto handler = manager->getFileHandler(paths[0].path());
+  BOOST_CHECK(handler->getAccessor<int>(FileHandler::kRead));
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUBadWatermark, LRUFixture) {
+  BOOST_CHECK_THROW(LRUFileManager(3, 3), Elements::Exception);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUWaitForRelease, LRUFixture) {
+  auto manager = std::make_shared<LRUFileManager>(1);
+  manager->setWaitForRelease(true, std::chrono::seconds(10));
+
+  auto handler1 = manager->getFileHandler(paths[0].path());
+  auto handler2 = manager->getFileHandler(paths[1].path());
+
+  auto accessor1 = handler1->getAccessor<int>(FileHandler::kRead);
+
+  // Blocks until accessor1 is released
+  std::thread thread([&accessor1]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    accessor1.reset();
+  });
+  auto accessor2 = handler2->getAccessor<int>(FileHandler::kRead);
+  thread.join();
+
+  BOOST_CHECK(accessor2);
+  BOOST_CHECK(!accessor1);
+  BOOST_CHECK_EQUAL(manager->getUsed(), 1);
+}
+
+//-----------------------------------------------------------------------------
+
+/// Exposes whether there is anyone waiting for room
+struct ObservableLRUFileManager : public LRUFileManager {
+  using LRUFileManager::LRUFileManager;
+  using FileManager::hasWaiters;
+};
+
+BOOST_FIXTURE_TEST_CASE(TestLRUWaitOrder, LRUFixture) {
+  auto manager = std::make_shared<ObservableLRUFileManager>(1);
+  manager->setWaitForRelease(true, std::chrono::seconds(10));
+
+  auto handler1 = manager->getFileHandler(paths[0].path());
+  auto handler2 = manager->getFileHandler(paths[1].path());
+  auto handler3 = manager->getFileHandler(paths[2].path());
+
+  std::mutex               order_mutex;
+  std::vector<std::string> order;
+  auto                     served = [&order_mutex, &order](const std::string& who) {
+    std::lock_guard<std::mutex> lock(order_mutex);
+    order.push_back(who);
+  };
+
+  auto        accessor1 = handler1->getAccessor<int>(FileHandler::kRead);
+  std::thread waiter([&handler2, &served]() {
+    auto accessor2 = handler2->getAccessor<int>(FileHandler::kRead);
+    served("waiter");
+  });
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!manager->hasWaiters() && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::yield();
+  }
+  BOOST_REQUIRE(manager->hasWaiters());
+
+  // The slot freed goes to the waiter, even if the newcomer asks for it first
+  accessor1.reset();
+  auto accessor3 = handler3->getAccessor<int>(FileHandler::kRead);
+  served("newcomer");
+  waiter.join();
+
+  std::vector<std::string> expected{"waiter", "newcomer"};
+  BOOST_CHECK_EQUAL_COLLECTIONS(order.begin(), order.end(), expected.begin(), expected.end());
+  BOOST_CHECK_EQUAL(manager->getUsed(), 1);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUWaitTimeout, LRUFixture) {
+  auto manager = std::make_shared<LRUFileManager>(1);
+  manager->setWaitForRelease(true, std::chrono::milliseconds(20));
+
+  auto handler1 = manager->getFileHandler(paths[0].path());
+  auto handler2 = manager->getFileHandler(paths[1].path());
+
+  auto accessor1 = handler1->getAccessor<int>(FileHandler::kRead);
+  BOOST_CHECK_THROW(handler2->getAccessor<int>(FileHandler::kRead), Elements::Exception);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUCounters, LRUFixture) {
+  constexpr int LIMIT = 2;
+
+  auto manager = std::make_shared<LRUFileManager>(LIMIT);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& path : paths) {
+    handlers.emplace_back(manager->getFileHandler(path.path()));
+  }
+
+  // Each file past the limit evicts one
+  for (auto& handler : handlers) {
+    handler->getAccessor<int>(FileHandler::kRead);
+  }
+
+  // All in use, so there is nothing to close
+  auto accessor1 = handlers[0]->getAccessor<int>(FileHandler::kRead);
+  auto accessor2 = handlers[1]->getAccessor<int>(FileHandler::kRead);
+  BOOST_CHECK_THROW(handlers[2]->getAccessor<int>(FileHandler::kRead), Elements::Exception);
+
+  // The two accessors had to evict the last two files opened
+  auto counters = manager->getCounters();
+  BOOST_CHECK_EQUAL(counters.m_evictions, NFILES - LIMIT + 2);
+  BOOST_CHECK_EQUAL(counters.m_refused_closes, 0);
+  BOOST_CHECK_EQUAL(counters.m_limit_reached, 1);
+  BOOST_CHECK_EQUAL(counters.m_peak_used, LIMIT);
+  BOOST_CHECK_EQUAL(counters.m_handlers.m_opened, NFILES + 2);
+  BOOST_CHECK_EQUAL(counters.m_handlers.m_forced_closes, counters.m_evictions);
+  BOOST_CHECK_EQUAL(counters.m_handlers.m_read_acquired, NFILES + 2);
+}
+
+//-----------------------------------------------------------------------------
+
+struct RecordingListener : public FileEventListener {
+  std::mutex               m_mutex;
+  std::vector<std::string> m_events;
+
+  void record(const std::string& event, const boost::filesystem::path& path) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_events.push_back(event + " " + path.filename().native());
+  }
+
+  void onOpen(const boost::filesystem::path& path, bool write, Duration) override {
+    record(write ? "open-write" : "open-read", path);
+  }
+
+  void onClose(const boost::filesystem::path& path, Duration) override {
+    record("close", path);
+  }
+
+  void onEvictionRequest(const boost::filesystem::path& path) override {
+    record("evict", path);
+  }
+
+  void onLockWait(const boost::filesystem::path& path, Duration duration) override {
+    BOOST_CHECK(duration > Duration::zero());
+    record("wait", path);
+  }
+};
+
+BOOST_FIXTURE_TEST_CASE(TestLRUEvents, LRUFixture) {
+  auto manager  = std::make_shared<LRUFileManager>(1);
+  auto listener = std::make_shared<RecordingListener>();
+  manager->setEventListener(listener);
+  manager->setLatencyHistograms(true);
+
+  auto handler1 = manager->getFileHandler(paths[0].path());
+  auto handler2 = manager->getFileHandler(paths[1].path());
+  auto name1    = paths[0].path().filename().native();
+  auto name2    = paths[1].path().filename().native();
+
+  handler1->getAccessor<int>(FileHandler::kRead);
+  handler2->getAccessor<int>(FileHandler::kRead);
+
+  // The reader has to wait for the writer
+  auto        writer = handler2->getAccessor<int>(FileHandler::kWrite);
+  std::thread thread([&writer]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    writer.reset();
+  });
+  handler2->getAccessor<int>(FileHandler::kRead);
+  thread.join();
+
+  std::vector<std::string> expected{"open-read " + name1, "evict " + name1,  "close " + name1, "open-read " + name2,
+                                    "close " + name2,     "open-write " + name2, "wait " + name2, "close " + name2,
+                                    "open-read " + name2};
+  BOOST_CHECK_EQUAL_COLLECTIONS(listener->m_events.begin(), listener->m_events.end(), expected.begin(), expected.end());
+
+  // The histograms are kept once enabled
+  auto sum = [](const std::vector<std::uint64_t>& counts) { return std::accumulate(counts.begin(), counts.end(), 0ul); };
+  BOOST_CHECK_EQUAL(sum(manager->getOpenLatency().getCounts()), 4);
+  BOOST_CHECK_EQUAL(sum(manager->getCloseLatency().getCounts()), 3);
+  BOOST_CHECK_EQUAL(sum(manager->getLockWaitLatency().getCounts()), 1);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRULatencyDisabled, LRUFixture) {
+  auto manager = std::make_shared<LRUFileManager>(1);
+  auto handler = manager->getFileHandler(paths[0].path());
+  handler->getAccessor<int>(FileHandler::kRead);
+  handler->getAccessor<int>(FileHandler::kWrite);
+
+  // Nothing is recorded unless asked to
+  auto sum = [](const std::vector<std::uint64_t>& counts) { return std::accumulate(counts.begin(), counts.end(), 0ul); };
+  BOOST_CHECK_EQUAL(sum(manager->getOpenLatency().getCounts()), 0);
+  BOOST_CHECK_EQUAL(sum(manager->getCloseLatency().getCounts()), 0);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUAccessorSet, LRUFixture) {
+  constexpr int LIMIT = 3;
+
+  auto manager = std::make_shared<LRUFileManager>(LIMIT);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& path : paths) {
+    handlers.emplace_back(manager->getFileHandler(path.path()));
+  }
+
+  // The first file is opened before the others, so it is the least recently used
+  for (int i : {0, 3, 4}) {
+    handlers[i]->getAccessor<int>(FileHandler::kRead);
+  }
+  BOOST_CHECK_EQUAL(manager->getUsed(), LIMIT);
+
+  // Making room for the set must not close the member already opened
+  auto accessors = FileHandler::getAccessors<int>(
+      {{handlers[2], FileHandler::kWrite}, {handlers[0], FileHandler::kRead}, {handlers[1], FileHandler::kRead}});
+  BOOST_REQUIRE_EQUAL(accessors.size(), 3);
+  BOOST_CHECK(!accessors[0]->isReadOnly());
+  BOOST_CHECK(accessors[1]->isReadOnly());
+  BOOST_CHECK(accessors[2]->isReadOnly());
+  BOOST_CHECK_EQUAL(manager->getUsed(), LIMIT);
+
+  for (int i : {0, 1}) {
+    char buffer[13];
+    BOOST_CHECK_EQUAL(::pread(accessors[i + 1]->m_fd, buffer, sizeof(buffer), 0), sizeof(buffer));
+    BOOST_CHECK_EQUAL(std::string(buffer, sizeof(buffer)), "THIS IS FILE ");
+  }
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUAccessorSetInvalid, LRUFixture) {
+  constexpr int LIMIT = 3;
+
+  auto manager = std::make_shared<LRUFileManager>(LIMIT);
+  auto other   = std::make_shared<LRUFileManager>(LIMIT);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& path : paths) {
+    handlers.emplace_back(manager->getFileHandler(path.path()));
+  }
+  handlers[0]->getAccessor<int>(FileHandler::kRead);
+
+  // The same file twice
+  BOOST_CHECK_THROW(
+      FileHandler::getAccessors<int>({{handlers[1], FileHandler::kRead}, {handlers[1], FileHandler::kWrite}}),
+      Elements::Exception);
+
+  // Different managers
+  BOOST_CHECK_THROW(FileHandler::getAccessors<int>({{handlers[1], FileHandler::kRead},
+                                                     {other->getFileHandler(paths[2].path()), FileHandler::kRead}}),
+                    Elements::Exception);
+
+  // More than the limit
+  std::vector<FileHandler::SetRequest> requests;
+  for (auto& handler : handlers) {
+    requests.emplace_back(handler, FileHandler::kWrite);
+  }
+  BOOST_CHECK_THROW(FileHandler::getAccessors<int>(requests), Elements::Exception);
+
+  // Nothing is kept after a failure
+  for (auto& handler : handlers) {
+    BOOST_CHECK(handler->getAccessor<int>(FileHandler::kTryWrite));
+  }
+  BOOST_CHECK_LE(manager->getUsed(), LIMIT);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUAccessorSetOrder, LRUFixture) {
+  constexpr int LIMIT = 2;
+
+  auto manager = std::make_shared<LRUFileManager>(LIMIT);
+  auto first   = manager->getFileHandler(paths[0].path());
+  auto second  = manager->getFileHandler(paths[1].path());
+
+  // Requested in opposite order, but acquired in the same one, so they can not deadlock
+  auto writer = [](std::shared_ptr<FileHandler> a, std::shared_ptr<FileHandler> b) {
+    for (int i = 0; i < 200; ++i) {
+      auto accessors = FileHandler::getAccessors<int>({{a, FileHandler::kWrite}, {b, FileHandler::kWrite}});
+      BOOST_CHECK_EQUAL(accessors.size(), 2);
+    }
+  };
+  std::thread thread1(writer, first, second);
+  std::thread thread2(writer, second, first);
+  thread1.join();
+  thread2.join();
+
+  BOOST_CHECK_EQUAL(manager->getUsed(), LIMIT);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUGroupMinimum, LRUFixture) {
+  constexpr int LIMIT = 3;
+
+  auto manager = std::make_shared<LRUFileManager>(LIMIT);
+  manager->defineGroup("catalog", 2);
+  manager->defineGroup("images", 0);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    handlers.emplace_back(manager->getFileHandler(paths[i].path(), i < 2 ? "catalog" : "images"));
+  }
+
+  // The catalogs are the least recently used, but they are within their minimum
+  for (auto& handler : handlers) {
+    handler->getAccessor<int>(FileHandler::kRead);
+  }
+  BOOST_CHECK_EQUAL(manager->getUsed(), LIMIT);
+  BOOST_CHECK_EQUAL(handlers[0]->getCounters().m_forced_closes, 0);
+  BOOST_CHECK_EQUAL(handlers[1]->getCounters().m_forced_closes, 0);
+  BOOST_CHECK_EQUAL(handlers[2]->getCounters().m_forced_closes, 1);
+  BOOST_CHECK_EQUAL(handlers[3]->getCounters().m_forced_closes, 1);
+  BOOST_CHECK_EQUAL(handlers[4]->getCounters().m_forced_closes, 0);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUGroupMaximum, LRUFixture) {
+  constexpr int LIMIT = 5;
+
+  auto manager = std::make_shared<LRUFileManager>(LIMIT);
+  manager->defineGroup("images", 0, 2);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    handlers.emplace_back(manager->getFileHandler(paths[i].path(), i < 2 ? "" : "images"));
+  }
+
+  // There is room below the limit, but the images can only replace each other
+  for (auto& handler : handlers) {
+    handler->getAccessor<int>(FileHandler::kRead);
+  }
+  BOOST_CHECK_EQUAL(manager->getUsed(), 4);
+  BOOST_CHECK_EQUAL(handlers[0]->getCounters().m_forced_closes, 0);
+  BOOST_CHECK_EQUAL(handlers[1]->getCounters().m_forced_closes, 0);
+  BOOST_CHECK_EQUAL(handlers[2]->getCounters().m_forced_closes, 1);
+
+  // More images at once than the maximum
+  BOOST_CHECK_THROW(FileHandler::getAccessors<int>({{handlers[2], FileHandler::kRead},
+                                                     {handlers[3], FileHandler::kRead},
+                                                     {handlers[4], FileHandler::kRead}}),
+                    Elements::Exception);
+
+  // Up to the maximum is fine, even if mixed with other groups
+  auto accessors = FileHandler::getAccessors<int>(
+      {{handlers[0], FileHandler::kRead}, {handlers[2], FileHandler::kRead}, {handlers[3], FileHandler::kRead}});
+  BOOST_CHECK_EQUAL(accessors.size(), 3);
+  BOOST_CHECK_LE(manager->getUsed(), 4);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(TestLRUGroupShare) {
+  constexpr int LIMIT = 6;
+
+  std::vector<Elements::TempPath> files(2 * LIMIT);
+  for (auto& file : files) {
+    std::ofstream stream(file.path().native());
+    stream << "THIS IS FILE " << file.path().native();
+  }
+
+  auto manager = std::make_shared<LRUFileManager>(LIMIT);
+  manager->defineGroup("a", 0);
+  manager->defineGroup("b", 0);
+
+  std::vector<std::shared_ptr<FileHandler>> a, b;
+  for (int i = 0; i < LIMIT; ++i) {
+    a.emplace_back(manager->getFileHandler(files[i].path(), "a"));
+    b.emplace_back(manager->getFileHandler(files[LIMIT + i].path(), "b"));
+  }
+
+  // Alone, a group can take the whole limit
+  for (auto& handler : a) {
+    handler->getAccessor<int>(FileHandler::kRead);
+  }
+  BOOST_CHECK_EQUAL(manager->getUsed(), LIMIT);
+
+  // The other group takes from it up to its share, and then replaces its own files,
+  // even if those of the first group are older
+  for (auto& handler : b) {
+    handler->getAccessor<int>(FileHandler::kRead);
+  }
+  BOOST_CHECK_EQUAL(manager->getUsed(), LIMIT);
+  for (int i = 0; i < LIMIT; ++i) {
+    BOOST_CHECK_EQUAL(a[i]->getCounters().m_forced_closes, i < LIMIT / 2 ? 1 : 0);
+    BOOST_CHECK_EQUAL(b[i]->getCounters().m_forced_closes, i < LIMIT / 2 ? 1 : 0);
+  }
+
+  // Now both are at their share, so the first group replaces its own files too
+  a[0]->getAccessor<int>(FileHandler::kRead);
+  BOOST_CHECK_EQUAL(a[LIMIT / 2]->getCounters().m_forced_closes, 1);
+  BOOST_CHECK_EQUAL(b[LIMIT / 2]->getCounters().m_forced_closes, 0);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUGroupInvalid, LRUFixture) {
+  auto manager = std::make_shared<LRUFileManager>(3);
+
+  BOOST_CHECK_THROW(manager->getFileHandler(paths[0].path(), "unknown"), Elements::Exception);
+  BOOST_CHECK_THROW(manager->defineGroup("bad", 3, 2), Elements::Exception);
+
+  // The default group can be capped too. With all its files in use, it fails as if the limit was reached
+  manager->defineGroup("", 0, 1);
+  auto handler1  = manager->getFileHandler(paths[0].path());
+  auto handler2  = manager->getFileHandler(paths[1].path());
+  auto accessor1 = handler1->getAccessor<int>(FileHandler::kRead);
+  BOOST_CHECK_THROW(handler2->getAccessor<int>(FileHandler::kRead), Elements::Exception);
+  BOOST_CHECK_EQUAL(manager->getUsed(), 1);
+}
+
+//-----------------------------------------------------------------------------
+
 BOOST_AUTO_TEST_SUITE_END()
 
 //-----------------------------------------------------------------------------
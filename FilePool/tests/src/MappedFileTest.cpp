@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include "FilePool/MappedFile.h"
+#include "ElementsKernel/Temporary.h"
+#include "FilePool/FileHandler.h"
+#include "FilePool/LRUFileManager.h"
+#include <boost/test/unit_test.hpp>
+#include <fstream>
+
+using namespace SourceXtractor;
+
+struct MappedFileFixture {
+  static constexpr int            NFILES = 2;
+  std::vector<Elements::TempPath> paths;
+  std::vector<std::string>        contents;
+
+  MappedFileFixture() : paths(NFILES) {
+    for (auto& path : paths) {
+      contents.emplace_back("THIS IS FILE " + path.path().native());
+      std::ofstream stream(path.path().native());
+      stream << contents.back();
+    }
+  }
+};
+
+/// Look for the file on the memory map of the process
+static bool isMapped(const boost::filesystem::path& path) {
+  std::ifstream maps("/proc/self/maps");
+  std::string   line;
+  while (std::getline(maps, line)) {
+    if (line.find(path.native()) != std::string::npos)
+      return true;
+  }
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE(MappedFileTest)
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestShared, MappedFileFixture) {
+  auto manager = std::make_shared<LRUFileManager>(2);
+  auto handler = manager->getFileHandler(paths[0].path());
+
+  auto reader1 = handler->getAccessor<MappedFile>(FileHandler::kRead);
+  auto reader2 = handler->getAccessor<MappedFile>(FileHandler::kRead);
+
+  // Same mapping, and no copies
+  BOOST_CHECK_EQUAL(static_cast<const void*>(reader1->m_fd.m_data), static_cast<const void*>(reader2->m_fd.m_data));
+  BOOST_CHECK(!reader1->m_fd.m_writable);
+  BOOST_CHECK_EQUAL(std::string(reader1->m_fd.begin(), reader1->m_fd.end()), contents[0]);
+  BOOST_CHECK_EQUAL(manager->getUsed(), 1);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestWrite, MappedFileFixture) {
+  auto manager = std::make_shared<LRUFileManager>(2);
+  auto handler = manager->getFileHandler(paths[0].path());
+
+  handler->setKeepOnModeSwitch(true);
+  {
+    auto writer = handler->getAccessor<MappedFile>(FileHandler::kWrite);
+    BOOST_REQUIRE(writer->m_fd.m_writable);
+    BOOST_REQUIRE_EQUAL(writer->m_fd.m_size, contents[0].size());
+    writer->m_fd.m_data[0] = 't';
+  }
+
+  // The change is visible to readers, even if they do not share the mapping
+  auto reader = handler->getAccessor<MappedFile>(FileHandler::kRead);
+  BOOST_CHECK_EQUAL(reader->m_fd.m_data[0], 't');
+  BOOST_CHECK_EQUAL(manager->getUsed(), 2);
+
+  // And it is written to the file
+  std::ifstream stream(paths[0].path().native());
+  std::string   line;
+  std::getline(stream, line);
+  BOOST_CHECK_EQUAL(line, "tHIS IS FILE " + paths[0].path().native());
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestEvict, MappedFileFixture) {
+  auto manager  = std::make_shared<LRUFileManager>(1);
+  auto handler0 = manager->getFileHandler(paths[0].path());
+  auto handler1 = manager->getFileHandler(paths[1].path());
+
+  handler0->getAccessor<MappedFile>(FileHandler::kRead);
+  BOOST_CHECK(isMapped(paths[0].path()));
+
+  // Mapping the second file unmaps the first
+  auto reader = handler1->getAccessor<MappedFile>(FileHandler::kRead);
+  BOOST_CHECK_EQUAL(std::string(reader->m_fd.begin(), reader->m_fd.end()), contents[1]);
+  BOOST_CHECK_EQUAL(manager->getUsed(), 1);
+  BOOST_CHECK(!isMapped(paths[0].path()));
+  BOOST_CHECK(isMapped(paths[1].path()));
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_CASE(TestMissing) {
+  BOOST_CHECK_THROW(OpenCloseTrait<MappedFile>::open("/this/does/not/exist", false), Elements::Exception);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE_END()
+
+//-----------------------------------------------------------------------------
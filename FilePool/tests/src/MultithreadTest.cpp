@@ -17,8 +17,12 @@
  */
 
 #include "ElementsKernel/Temporary.h"
+#include "FilePool/BudgetFileManager.h"
+#include "FilePool/ClockFileManager.h"
 #include "FilePool/FileHandler.h"
 #include "FilePool/LRUFileManager.h"
+#include "FilePool/ShardedLRUFileManager.h"
+#include "FilePool/TwoQueueFileManager.h"
 #include <boost/random.hpp>
 #include <boost/test/unit_test.hpp>
 #include <boost/thread.hpp>
@@ -96,4 +100,83 @@ BOOST_AUTO_TEST_CASE(MultithreadTest) {
 
 //-----------------------------------------------------------------------------
 
+// With less descriptors than threads, waiting for a release should avoid any failure
+BOOST_AUTO_TEST_CASE(MultithreadWaitTest) {
+  auto                                      manager = std::make_shared<LRUFileManager>(3);
+  std::list<Elements::TempPath>             temp_files;
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  boost::thread_group                       thread_group;
+
+  manager->setWaitForRelease(true);
+
+  for (int i = 0; i < 5; ++i) {
+    temp_files.emplace_back();
+    std::ofstream(temp_files.back().path().native()) << "THIS IS FILE " << i;
+    handlers.emplace_back(manager->getFileHandler(temp_files.back().path()));
+  }
+
+  for (int t = 0; t < 8; ++t) {
+    thread_group.create_thread([&handlers, t]() {
+      for (int i = 0; i < 50; ++i) {
+        try {
+          auto accessor = handlers[(t + i) % handlers.size()]->getAccessor<int>(FileHandler::kRead);
+          boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+        } catch (const Elements::Exception& e) {
+          BOOST_ERROR(e.what());
+        }
+      }
+    });
+  }
+  thread_group.join_all();
+  BOOST_CHECK_LE(manager->getUsed(), 3);
+}
+
+//-----------------------------------------------------------------------------
+
+// The files being opened count towards the limit, so it is never exceeded, not even for a moment
+BOOST_AUTO_TEST_CASE(MultithreadPeakTest) {
+  std::vector<std::shared_ptr<FileManager>> managers{
+      std::make_shared<LRUFileManager>(4), std::make_shared<ClockFileManager>(4),
+      std::make_shared<TwoQueueFileManager>(4), std::make_shared<BudgetFileManager>(4, 1024 * 1024),
+      std::make_shared<ShardedLRUFileManager>(4)};
+
+  for (auto& manager : managers) {
+    std::list<Elements::TempPath>             temp_files;
+    std::vector<std::shared_ptr<FileHandler>> handlers;
+    boost::thread_group                       thread_group;
+
+    manager->setWaitForRelease(true);
+
+    for (int i = 0; i < 6; ++i) {
+      temp_files.emplace_back();
+      std::ofstream(temp_files.back().path().native()) << "THIS IS FILE " << i;
+      handlers.emplace_back(manager->getFileHandler(temp_files.back().path()));
+    }
+
+    for (int t = 0; t < 8; ++t) {
+      thread_group.create_thread([&handlers, t]() {
+        for (int i = 0; i < 50; ++i) {
+          auto& first  = handlers[(t + i) % handlers.size()];
+          auto& second = handlers[(t + 2 * i + 1) % handlers.size()];
+          try {
+            if (i % 2 == 0 && first != second) {
+              auto accessors = FileHandler::getAccessors<int>({{first, FileHandler::kRead}, {second, FileHandler::kRead}});
+              boost::this_thread::sleep(boost::posix_time::microseconds(500));
+            } else {
+              auto accessor = first->getAccessor<int>(FileHandler::kRead);
+              boost::this_thread::sleep(boost::posix_time::microseconds(500));
+            }
+          } catch (const Elements::Exception& e) {
+            BOOST_ERROR(e.what());
+          }
+        }
+      });
+    }
+    thread_group.join_all();
+    BOOST_CHECK_LE(manager->getCounters().m_peak_used, 4);
+  }
+}
+
+//-----------------------------------------------------------------------------
+
 BOOST_AUTO_TEST_SUITE_END()
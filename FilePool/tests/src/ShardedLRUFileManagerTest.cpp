@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/ShardedLRUFileManager.h"
+#include "ElementsKernel/Temporary.h"
+#include "FilePool/FileHandler.h"
+#include <boost/test/unit_test.hpp>
+#include <set>
+#include <boost/thread.hpp>
+
+#include "TestFileTraits.h"
+
+using namespace SourceXtractor;
+
+struct ShardedLRUFixture {
+  static constexpr int            NFILES = 5;
+  std::vector<Elements::TempPath> paths;
+
+  ShardedLRUFixture() : paths(NFILES) {
+    for (auto& path : paths) {
+      std::ofstream stream(path.path().native());
+      stream << "THIS IS FILE " << path.path().native();
+    }
+  }
+};
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE(ShardedLRUFileManagerTest)
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRU, ShardedLRUFixture) {
+  constexpr int LIMIT = 3;
+
+  ShardedLRUFileManager              manager(LIMIT, 4);
+  std::map<FileManager::FileId, int> descriptors;
+  std::vector<FileManager::FileId>   order_closed;
+
+  auto close_callback = [&](FileManager::FileId id) mutable {
+    order_closed.push_back(id);
+    auto iter = descriptors.find(id);
+    manager.close(iter->first, iter->second);
+    descriptors.erase(iter);
+    return true;
+  };
+
+  // Open all files
+  std::vector<FileManager::FileId> order_opened;
+  for (auto& path : paths) {
+    auto pair = manager.open<int>(path.path(), false, close_callback);
+    descriptors.emplace(pair);
+    order_opened.push_back(pair.first);
+  }
+
+  // The oldest across all shards should have been closed first
+  BOOST_REQUIRE_EQUAL(order_closed.size(), NFILES - LIMIT);
+  for (int i = 0; i < NFILES - LIMIT; ++i) {
+    BOOST_CHECK_EQUAL(order_opened[i], order_closed[i]);
+  }
+  BOOST_CHECK_EQUAL(manager.getUsed(), LIMIT);
+  BOOST_CHECK_EQUAL(manager.getAvailable(), 0);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUMultiple, ShardedLRUFixture) {
+  constexpr int LIMIT = 3;
+
+  ShardedLRUFileManager              manager(LIMIT, 4);
+  std::map<FileManager::FileId, int> descriptors;
+  std::vector<FileManager::FileId>   order_closed;
+
+  auto close_callback = [&](FileManager::FileId id) mutable {
+    order_closed.push_back(id);
+    auto iter = descriptors.find(id);
+    manager.close(iter->first, iter->second);
+    descriptors.erase(iter);
+    return true;
+  };
+
+  std::vector<FileManager::FileId> order_opened;
+  for (auto i = paths.begin(); i != paths.end() && order_opened.size() < 3; ++i) {
+    auto pair = manager.open<int>(i->path(), false, close_callback);
+    descriptors.emplace(pair);
+    order_opened.push_back(pair.first);
+  }
+
+  // Re-use one and two
+  manager.notifyUsed(order_opened[0]);
+  manager.notifyUsed(order_opened[1]);
+
+  for (auto i = paths.begin(); i != paths.end() && order_opened.size() < 5; ++i) {
+    auto pair = manager.open<int>(i->path(), false, close_callback);
+    descriptors.emplace(pair);
+    order_opened.push_back(pair.first);
+  }
+
+  BOOST_REQUIRE_EQUAL(order_closed.size(), 2);
+  BOOST_CHECK_EQUAL(order_closed[0], order_opened[2]);
+  BOOST_CHECK_EQUAL(order_closed[1], order_opened[0]);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLRUSkipInUse, ShardedLRUFixture) {
+  constexpr int LIMIT = 3;
+
+  ShardedLRUFileManager              manager(LIMIT, 4);
+  std::map<FileManager::FileId, int> descriptors;
+  std::set<FileManager::FileId>      in_use;
+  std::vector<FileManager::FileId>   order_requested;
+
+  auto close_callback = [&](FileManager::FileId id) mutable {
+    order_requested.push_back(id);
+    if (in_use.count(id))
+      return false;
+    auto iter = descriptors.find(id);
+    manager.close(iter->first, iter->second);
+    descriptors.erase(iter);
+    return true;
+  };
+
+  std::vector<FileManager::FileId> order_opened;
+  for (int i = 0; i < LIMIT; ++i) {
+    auto pair = manager.open<int>(paths[i].path(), false, close_callback);
+    descriptors.emplace(pair);
+    order_opened.push_back(pair.first);
+  }
+
+  // The two oldest are handed to an accessor, so only the third can be closed
+  for (int i = 0; i < 2; ++i) {
+    manager.notifyAcquired(order_opened[i]);
+    in_use.insert(order_opened[i]);
+  }
+  auto pair = manager.open<int>(paths[3].path(), false, close_callback);
+  descriptors.emplace(pair);
+
+  // The files in use must not even be asked
+  BOOST_REQUIRE_EQUAL(order_requested.size(), 1);
+  BOOST_CHECK_EQUAL(order_requested[0], order_opened[2]);
+
+  // Once released, the second is the only one idle
+  manager.notifyAcquired(pair.first);
+  in_use.insert(pair.first);
+  in_use.erase(order_opened[1]);
+  manager.notifyReleased(order_opened[1]);
+  manager.open<int>(paths[4].path(), false, close_callback);
+
+  BOOST_REQUIRE_EQUAL(order_requested.size(), 2);
+  BOOST_CHECK_EQUAL(order_requested[1], order_opened[1]);
+  BOOST_CHECK_EQUAL(manager.getUsed(), LIMIT);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestOpenFailed, ShardedLRUFixture) {
+  ShardedLRUFileManager manager(3, 2);
+
+  BOOST_CHECK_THROW(manager.open<int>(paths[0].path() / "missing", false, [](FileManager::FileId) { return false; }),
+                    Elements::Exception);
+  BOOST_CHECK_EQUAL(manager.getUsed(), 0);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestLimitMultithread, ShardedLRUFixture) {
+  constexpr int LIMIT = 3;
+
+  auto manager = std::make_shared<ShardedLRUFileManager>(LIMIT, 2);
+
+  std::vector<std::shared_ptr<FileHandler>> handlers;
+  for (auto& path : paths) {
+    handlers.emplace_back(manager->getFileHandler(path.path()));
+  }
+
+  boost::thread_group thread_group;
+  for (int t = 0; t < 3; ++t) {
+    thread_group.create_thread([&handlers, &manager, t]() {
+      for (int i = 0; i < 200; ++i) {
+        auto accessor = handlers[(i + t) % handlers.size()]->getAccessor<int>(FileHandler::kRead);
+        BOOST_CHECK_LE(manager->getUsed(), manager->getLimit());
+      }
+    });
+  }
+  thread_group.join_all();
+
+  BOOST_CHECK_LE(manager->getUsed(), LIMIT);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE_END()
+
+//-----------------------------------------------------------------------------
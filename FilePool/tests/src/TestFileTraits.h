@@ -48,12 +48,28 @@ struct OpenCloseTrait<int> {
     return fd;
   }
 
+  static int openUpdate(const boost::filesystem::path& path) {
+    int fd = ::open(path.native().c_str(), O_CREAT | O_RDWR, 0700);
+    if (fd < 0) {
+      throw Elements::Exception() << strerror(errno);
+    }
+    return fd;
+  }
+
   static void close(int fd) {
     if (::close(fd) < 0) {
       BOOST_ERROR(strerror(errno));
     }
   }
 
+  static void advise(int fd, int advice, off_t offset, off_t length) {
+    posix_fadvise(fd, offset, length, advice);
+  }
+
+  static int nativeHandle(int fd) {
+    return fd;
+  }
+
   // This two are not part of the original trait! They are here for convenience
   static void write(int& fd, const std::string& buf) {
     if (::write(fd, buf.c_str(), buf.size()) < static_cast<ssize_t>(buf.size())) {
@@ -83,6 +99,10 @@ struct OpenCloseTrait<CfitsioLike*> {
     return new CfitsioLike{fd, new char[1024]};
   }
 
+  static CfitsioLike* openUpdate(const boost::filesystem::path& path) {
+    return new CfitsioLike{OpenCloseTrait<int>::openUpdate(path), new char[1024]};
+  }
+
   static void close(CfitsioLike* ptr) {
     if (::close(ptr->fd) < 0) {
       BOOST_ERROR(strerror(errno));
@@ -91,6 +111,10 @@ struct OpenCloseTrait<CfitsioLike*> {
     delete ptr;
   }
 
+  static std::size_t cost(const CfitsioLike*) {
+    return 1024;
+  }
+
   // This two are not part of the original trait! They are here for convenience
   static void write(CfitsioLike* ptr, const std::string& buf) {
     if (::write(ptr->fd, buf.c_str(), buf.size()) < static_cast<ssize_t>(buf.size())) {
@@ -122,6 +146,14 @@ struct OpenCloseTrait<std::fstream> {
     return stream;
   }
 
+  static std::fstream openUpdate(const boost::filesystem::path& path) {
+    // in | out does not create the file, so create it first
+    std::ofstream(path.native(), std::ios_base::app);
+    std::fstream stream(path.native(), std::ios_base::in | std::ios_base::out);
+    stream.exceptions(std::fstream::failbit | std::fstream::badbit);
+    return stream;
+  }
+
   static void close(std::fstream& stream) {
     stream.close();
   }
@@ -139,6 +171,53 @@ struct OpenCloseTrait<std::fstream> {
 };
 #endif
 
+/**
+ * A descriptor only used with positional I/O, so it can be shared between readers
+ */
+struct PositionalFd {
+  int fd;
+};
+
+template <>
+struct OpenCloseTrait<PositionalFd> {
+  static constexpr bool kShareable = true;
+
+  static PositionalFd open(const boost::filesystem::path& path, bool write) {
+    return PositionalFd{OpenCloseTrait<int>::open(path, write)};
+  }
+
+  static PositionalFd openUpdate(const boost::filesystem::path& path) {
+    return PositionalFd{OpenCloseTrait<int>::openUpdate(path)};
+  }
+
+  static void close(PositionalFd& pfd) {
+    OpenCloseTrait<int>::close(pfd.fd);
+  }
+
+  static void advise(PositionalFd& pfd, int advice, off_t offset, off_t length) {
+    OpenCloseTrait<int>::advise(pfd.fd, advice, offset, length);
+  }
+
+  static int nativeHandle(const PositionalFd& pfd) {
+    return pfd.fd;
+  }
+
+  // This two are not part of the original trait! They are here for convenience
+  static void write(PositionalFd& pfd, const std::string& buf) {
+    if (::pwrite(pfd.fd, buf.c_str(), buf.size(), 0) < static_cast<ssize_t>(buf.size())) {
+      BOOST_ERROR(strerror(errno));
+    }
+  }
+
+  static std::string read(PositionalFd& pfd) {
+    char buffer[1024] = {0};
+    if (::pread(pfd.fd, buffer, sizeof(buffer), 0) <= 0) {
+      BOOST_ERROR(strerror(errno));
+    }
+    return buffer;
+  }
+};
+
 }  // namespace SourceXtractor
 
 #endif  // POOLTESTS_TESTFILETRAITS_H
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2012-2021 Euclid Science Ground Segment
+ *
+ * This library is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 3.0 of the License, or (at your option)
+ * any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "FilePool/TwoQueueFileManager.h"
+#include "ElementsKernel/Temporary.h"
+#include <boost/test/unit_test.hpp>
+
+#include "TestFileTraits.h"
+
+using namespace SourceXtractor;
+
+struct TwoQueueFixture {
+  static constexpr int                     NFILES = 10;
+  static constexpr int                     LIMIT  = 4;
+  std::vector<Elements::TempPath>          paths;
+  TwoQueueFileManager                      manager;
+  std::map<FileManager::FileId, int>       descriptors;
+  std::vector<FileManager::FileId>         order_closed;
+  std::function<bool(FileManager::FileId)> close_callback;
+
+  TwoQueueFixture() : paths(NFILES), manager(LIMIT) {
+    for (auto& path : paths) {
+      std::ofstream stream(path.path().native());
+      stream << "THIS IS FILE " << path.path().native();
+    }
+    close_callback = [this](FileManager::FileId id) {
+      order_closed.push_back(id);
+      auto iter = descriptors.find(id);
+      manager.close(iter->first, iter->second);
+      descriptors.erase(iter);
+      return true;
+    };
+  }
+
+  FileManager::FileId openAndUse(const Elements::TempPath& path) {
+    auto pair = manager.open<int>(path.path(), false, close_callback);
+    descriptors.emplace(pair);
+    manager.notifyUsed(pair.first);
+    return pair.first;
+  }
+};
+
+constexpr int TwoQueueFixture::NFILES;
+constexpr int TwoQueueFixture::LIMIT;
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE(TwoQueueFileManagerTest)
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestFIFO, TwoQueueFixture) {
+  // Files used only once are closed in the same order they were opened
+  std::vector<FileManager::FileId> order_opened;
+  for (auto& path : paths) {
+    order_opened.push_back(openAndUse(path));
+  }
+
+  BOOST_REQUIRE_EQUAL(order_closed.size(), NFILES - LIMIT);
+  for (int i = 0; i < NFILES - LIMIT; ++i) {
+    BOOST_CHECK_EQUAL(order_opened[i], order_closed[i]);
+  }
+  BOOST_CHECK_EQUAL(manager.getUsed(), LIMIT);
+  BOOST_CHECK_EQUAL(manager.getAvailable(), 0);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestScanResistance, TwoQueueFixture) {
+  // Used twice, so it is frequent
+  auto hot = openAndUse(paths[0]);
+  manager.notifyUsed(hot);
+
+  // A pass over the rest of files must not close the frequent one
+  for (int i = 1; i < NFILES; ++i) {
+    openAndUse(paths[i]);
+  }
+
+  BOOST_CHECK_EQUAL(order_closed.size(), NFILES - LIMIT);
+  BOOST_CHECK(std::find(order_closed.begin(), order_closed.end(), hot) == order_closed.end());
+  BOOST_CHECK_EQUAL(manager.getUsed(), LIMIT);
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_FIXTURE_TEST_CASE(TestGhost, TwoQueueFixture) {
+  auto first = openAndUse(paths[0]);
+  for (int i = 1; i <= LIMIT; ++i) {
+    openAndUse(paths[i]);
+  }
+  BOOST_REQUIRE_EQUAL(order_closed.size(), 1);
+  BOOST_CHECK_EQUAL(order_closed[0], first);
+
+  // Re-opened after being evicted, so it goes straight into the frequent queue
+  // Note that the FileId may be the same as before, since the memory is reused
+  auto reopened = openAndUse(paths[0]);
+  order_closed.clear();
+  for (int i = LIMIT + 1; i < NFILES; ++i) {
+    openAndUse(paths[i]);
+  }
+  BOOST_CHECK_EQUAL(order_closed.size(), NFILES - LIMIT - 1);
+  BOOST_CHECK(std::find(order_closed.begin(), order_closed.end(), reopened) == order_closed.end());
+}
+
+//-----------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE_END()
+
+//-----------------------------------------------------------------------------